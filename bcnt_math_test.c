@@ -0,0 +1,213 @@
+/*
+ * bcnt_math_test.c
+ * Checks the integer counter math of rlm_backcounter against the double
+ * formulas it replaced (rlm_backcounter 0.1)
+ *
+ * Build and run standalone, without FreeRADIUS:
+ *   cc -std=gnu99 -Wall -o bcnt_math_test bcnt_math_test.c -lm && ./bcnt_math_test
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "rlm_backcounter_int.h"
+
+#define TWO63 9223372036854775808.0
+
+static int failed = 0, checked = 0;
+
+/** Old conversion of a double counter to the int64_t range
+ * (the double was truncated when written to db or to a VP) */
+static int64_t old_int(double d)
+{
+	if (d >= TWO63)
+		return INT64_MAX;
+	if (d <= -TWO63)
+		return INT64_MIN;
+
+	return (int64_t) d;
+}
+
+/** Compares new result with old one
+ * Allows one unit, plus the rounding error of the old double math, which
+ * has 53 bits of precision only. */
+static void check(const char *what, const char *factor, int64_t val,
+                  int64_t got, double old)
+{
+	int64_t exp = old_int(old);
+	double diff = fabs((double) got - (double) exp);
+	double tol = 1.0 + fabs(old) * 4.0 * ldexp(1.0, -53);
+
+	checked++;
+	if (diff <= tol)
+		return;
+
+	failed++;
+	printf("FAIL %s factor=%s value=%" PRId64 ": got %" PRId64 ", old %" PRId64 "\n",
+		what, factor, val, got, exp);
+}
+
+/** Level factor scaling in authorize (counter / factor) and in accounting
+ * (sum * factor) */
+static void test_scale(void)
+{
+	static const char *factors[] = {
+		"0.5", "1.5", "1000", "0.000001", "1", "0.25", "2.75", NULL };
+	int64_t values[64];
+	int64_t fixed, v;
+	double f;
+	int i, j, n = 0, d;
+
+	values[n++] = 0;
+	values[n++] = 1;
+	values[n++] = -1;
+	values[n++] = 3;
+	values[n++] = -7;
+	values[n++] = 1000000;
+	for (d = -3; d <= 3; d++) {
+		values[n++] = ((int64_t) 1 << 32) + d;      /* around 2^32 */
+		values[n++] = -((int64_t) 1 << 32) + d;
+	}
+	for (d = 0; d < 4; d++) {
+		values[n++] = INT64_MAX - d;                 /* around 2^63 */
+		values[n++] = INT64_MIN + d;                 /* around INT64_MIN */
+	}
+	values[n++] = (int64_t) 1 << 62;
+	values[n++] = INT64_MAX / 1000;
+	values[n++] = INT64_MAX / 1000 + 1;
+	values[n++] = INT64_MIN / 1000 - 1;
+
+	for (i = 0; factors[i]; i++) {
+		fixed = bcnt_fixed(factors[i]);
+		f = strtod(factors[i], (char **) NULL);
+
+		if (fixed != (int64_t) (f * RLM_BC_FP_ONE + 0.5)) {
+			failed++;
+			printf("FAIL bcnt_fixed(%s) = %" PRId64 "\n", factors[i], fixed);
+		}
+		checked++;
+
+		for (j = 0; j < n; j++) {
+			v = values[j];
+			check("authorize", factors[i], v,
+				bcnt_scale(v, RLM_BC_FP_ONE, fixed), (double) v / f);
+			check("accounting", factors[i], v,
+				bcnt_scale(v, fixed, RLM_BC_FP_ONE), (double) v * f);
+		}
+	}
+
+	/* factors finer than the fixed-point precision are cut, not rounded */
+	if (bcnt_fixed("0.0000009") != 0 || bcnt_fixed("1.0000019") != 1000001 ||
+	    bcnt_fixed("1000.000001") != RLM_BC_FP_MAX + 1 ||
+	    bcnt_fixed("99999999999999999999") != RLM_BC_FP_MAX + 1) {
+		failed++;
+		printf("FAIL bcnt_fixed() precision or limit\n");
+	}
+	checked++;
+
+	/* a zero factor saturates instead of dividing by zero */
+	if (bcnt_scale(5, RLM_BC_FP_ONE, 0) != INT64_MAX ||
+	    bcnt_scale(-5, RLM_BC_FP_ONE, 0) != INT64_MIN ||
+	    bcnt_scale(0, RLM_BC_FP_ONE, 0) != 0) {
+		failed++;
+		printf("FAIL bcnt_scale() with zero factor\n");
+	}
+	checked++;
+}
+
+/** Parsing of counters stored in db (strtod() before) */
+static void test_parse(void)
+{
+	static const char *strs[] = {
+		"0", "1", "-1", "512", "-512", "1.5", "-2.7", "1e3", "1E3", "12.99abc",
+		"4294967295", "4294967296", "4294967297", "-4294967296",
+		"9223372036854775806", "9223372036854775807", "9223372036854775808",
+		"99999999999999999999", "9.3e18", "1e300",
+		"-9223372036854775807", "-9223372036854775808", "-9223372036854775809",
+		"-9.3e18", "-1e300", "", "abc", NULL };
+	int i;
+
+	for (i = 0; strs[i]; i++)
+		check("parse", "-", i, bcnt_parse(strs[i]), strtod(strs[i], (char **) NULL));
+
+	if (bcnt_parse(NULL) != 0) {
+		failed++;
+		printf("FAIL bcnt_parse(NULL)\n");
+	}
+	checked++;
+}
+
+/** Splitting of guard value into guardvap and giga_guardvap
+ * The new split must give the value back exactly. The old one divided by
+ * UINT32_MAX instead of 2^32 - its differences are reported, not failed. */
+static void test_split(void)
+{
+	int64_t values[32], v;
+	uint32_t low, high;
+	double old;
+	int i, n = 0, d, olddiff = 0;
+
+	for (d = -2; d <= 2; d++)
+		values[n++] = ((int64_t) 1 << 32) + d;       /* around 2^32 */
+	values[n++] = ((int64_t) 5 << 32) - 1;
+	values[n++] = (int64_t) UINT32_MAX << 31;
+	values[n++] = ((int64_t) 1 << 62) + 12345;
+	for (d = 0; d < 3; d++)
+		values[n++] = INT64_MAX - d;                 /* around 2^63 */
+	values[n++] = 0;
+	values[n++] = 1;
+	values[n++] = UINT32_MAX;
+
+	for (i = 0; i < n; i++) {
+		v = values[i];
+
+		low = bcnt_split(v, &high);
+		checked++;
+		if ((((int64_t) high << 32) | low) != v) {
+			failed++;
+			printf("FAIL bcnt_split(%" PRId64 ") = %" PRIu32 ", %" PRIu32 "\n",
+				v, high, low);
+		}
+
+		checked++;
+		if (bcnt_split(v, NULL) != ((v > UINT32_MAX) ? UINT32_MAX : (uint32_t) v)) {
+			failed++;
+			printf("FAIL bcnt_split(%" PRId64 ", NULL)\n", v);
+		}
+
+		/* old: (uint32_t) counter, (uint32_t) (counter / UINT32_MAX) */
+		if (v > UINT32_MAX) {
+			old = (double) v;
+			if ((uint32_t) (old / UINT32_MAX) != high) {
+				olddiff++;
+				printf("note: old giga_guardvap of %" PRId64 " was %" PRIu32
+					", now %" PRIu32 "\n", v, (uint32_t) (old / UINT32_MAX), high);
+			}
+		}
+	}
+
+	printf("%d of %d split values differ from the old formula\n", olddiff, n);
+}
+
+int main(void)
+{
+	test_scale();
+	test_parse();
+	test_split();
+
+	printf("%d checks, %d failed\n", checked, failed);
+	return failed ? 1 : 0;
+}
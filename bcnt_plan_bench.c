@@ -0,0 +1,216 @@
+/*
+ * bcnt_plan_bench.c
+ * Times the single-pass accounting extraction plan of rlm_backcounter against
+ * one pairfind() per attribute, on Accounting-Stop packets with many VPs
+ *
+ * Build and run standalone, without FreeRADIUS:
+ *   cc -std=gnu99 -O2 -Wall -o bcnt_plan_bench bcnt_plan_bench.c && ./bcnt_plan_bench [vps]
+ *
+ * The VP list and both lookups are stand-ins for the FreeRADIUS 2.1 ones:
+ * vp_t has the size of VALUE_PAIR, pairfind() and plan_extract() copy the
+ * loops of src/lib/valuepair.c and bcnt_plan_extract().
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define MAX_SLOTS 16
+#define ROUNDS 20000
+
+/* attributes needed by accounting: Acct-Status-Type, Acct-Session-Time,
+ * Acct-Delay-Time, then count_names with their gigawords, as laid out by
+ * bcnt_plan_slot() for count_names = "Acct-Input-Octets Acct-Output-Octets" */
+static const int plan[] = { 40, 46, 41, 42, 52, 43, 53 };
+#define PLAN_LEN ((int) (sizeof(plan) / sizeof(plan[0])))
+
+typedef struct vp_t {
+	char           name[40];
+	int            attribute;
+	int            vendor;
+	int            type;
+	size_t         length;
+	int            operator;
+	int            flags;
+	struct vp_t   *next;
+	uint32_t       lvalue;
+	char           strvalue[254];
+} vp_t;
+
+static vp_t *pairfind(vp_t *first, int attr)
+{
+	while (first && first->attribute != attr)
+		first = first->next;
+
+	return first;
+}
+
+/** Per-attribute lookups, as rlm_backcounter did before the plan */
+static unsigned long lookup_pairfind(vp_t *vps, vp_t **slots)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < PLAN_LEN; i++) {
+		slots[i] = pairfind(vps, plan[i]);
+		if (slots[i])
+			sum += slots[i]->lvalue;
+	}
+
+	return sum;
+}
+
+/** Single walk, as bcnt_plan_extract() */
+static unsigned long lookup_plan(vp_t *vps, vp_t **slots)
+{
+	unsigned long sum = 0;
+	vp_t *vp;
+	int i, found = 0;
+
+	memset(slots, 0, sizeof(vp_t *) * MAX_SLOTS);
+
+	for (vp = vps; vp && found < PLAN_LEN; vp = vp->next) {
+		for (i = 0; i < PLAN_LEN; i++) {
+			if (plan[i] != vp->attribute)
+				continue;
+
+			if (!slots[i]) {
+				slots[i] = vp;
+				found++;
+			}
+			break;
+		}
+	}
+
+	for (i = 0; i < PLAN_LEN; i++)
+		if (slots[i])
+			sum += slots[i]->lvalue;
+
+	return sum;
+}
+
+/** Builds a Stop packet of n VPs, allocated in random order like a long-running
+ * server's heap would give them
+ * @param at          where in the list the needed attributes go: 0 - first,
+ *                    1 - spread over the list, 2 - last
+ * @param giga        whether the gigawords attributes are present */
+static vp_t *packet(int n, int at, int giga)
+{
+	vp_t **all, *vps = NULL;
+	int i, j, k, pos, needed = giga ? PLAN_LEN : PLAN_LEN - 2;
+	int attrs[PLAN_LEN];
+
+	for (i = 0, k = 0; i < PLAN_LEN; i++)
+		if (giga || (plan[i] != 52 && plan[i] != 53))
+			attrs[k++] = plan[i];
+
+	all = calloc(n, sizeof(vp_t *));
+	for (i = 0; i < n; i++)
+		all[i] = calloc(1, sizeof(vp_t));
+
+	/* shuffle so that list order is not memory order */
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		vps = all[i]; all[i] = all[j]; all[j] = vps;
+	}
+	vps = NULL;
+
+	/* filler: vendor-specific and other attributes nobody counts */
+	for (i = 0; i < n; i++) {
+		all[i]->attribute = (26 << 16) | (1000 + i);
+		all[i]->lvalue = i;
+	}
+
+	for (k = 0; k < needed; k++) {
+		switch (at) {
+			case 0:  pos = k; break;
+			case 1:  pos = (k + 1) * n / (needed + 1); break;
+			default: pos = n - needed + k; break;
+		}
+		all[pos]->attribute = attrs[k];
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		all[i]->next = vps;
+		vps = all[i];
+	}
+
+	free(all);
+	return vps;
+}
+
+static void packet_free(vp_t *vps)
+{
+	vp_t *next;
+
+	for (; vps; vps = next) {
+		next = vps->next;
+		free(vps);
+	}
+}
+
+static double now_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static void run(int n, int at, int giga)
+{
+	static const char *where[] = { "first", "spread", "last" };
+	vp_t *vps = packet(n, at, giga), *a[MAX_SLOTS], *b[MAX_SLOTS];
+	volatile unsigned long sink = 0;
+	double t0, t1, t2;
+	int r;
+
+	if (lookup_pairfind(vps, a) != lookup_plan(vps, b) || memcmp(a, b, sizeof(vp_t *) * PLAN_LEN)) {
+		printf("plan and pairfind() disagree\n");
+		exit(1);
+	}
+
+	t0 = now_ns();
+	for (r = 0; r < ROUNDS; r++)
+		sink += lookup_pairfind(vps, a);
+	t1 = now_ns();
+	for (r = 0; r < ROUNDS; r++)
+		sink += lookup_plan(vps, b);
+	t2 = now_ns();
+
+	printf("%5d VPs, needed %-6s %-11s  pairfind %8.0f ns  plan %8.0f ns  %5.2fx\n",
+		n, where[at], giga ? "" : "(no giga)",
+		(t1 - t0) / ROUNDS, (t2 - t1) / ROUNDS, (t1 - t0) / (t2 - t1));
+
+	packet_free(vps);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[] = { 20, 200, 500 }, i, at;
+
+	srand(1);
+
+	if (argc > 1)
+		sizes[0] = sizes[1] = sizes[2] = atoi(argv[1]);
+
+	for (i = 0; i < 3; i++) {
+		for (at = 0; at < 3; at++)
+			run(sizes[i], at, 1);
+		run(sizes[i], 1, 0);
+	}
+
+	return 0;
+}
@@ -22,11 +22,9 @@
  *               2000-2009 The FreeRADIUS server project
  *
  * Current bugs/limits:
- * - probably works only with MySQL
+ * - default queries of the "sql" backend probably work only with MySQL
  * - it's too bit "hardcoded"
- *   - queries and table names are not configurable
  *   - access to user attributes is too low-level
- * - handles only at most 32-bit counters for single session (but "any" size in db)
  */
 
 #include <stdio.h>
@@ -34,7 +32,27 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_unlock(_x)
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#endif
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
@@ -42,61 +60,430 @@
 #include <freeradius-devel/modpriv.h>
 
 #include "../rlm_sql/rlm_sql.h"
+#include "rlm_backcounter_int.h"
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
 
 #define RLM_BC_VERSION "0.2"
 
 #define RLM_BC_MAX_ROWS 1000000
 #define RLM_BC_TMP_PREFIX "auth-tmp-"
+#define RLM_BC_MAX_SLOTS 32
+#define RLM_BC_ROLLUP_PERIOD 3600
+#define RLM_BC_ROLLUP_BATCH (MAX_QUERY_LEN / 16) /* max rows in one upsert, each is 16+ chars */
+#define RLM_BC_ROLLUP_TRIES 5     /* flushes of a bucket before it's dropped */
+#define RLM_BC_ROLLUP_MAX(data) (2 * (data)->rollup_size) /* pending buckets kept at most */
+#define RLM_BC_CTL_CLIENTS 16
+#define RLM_BC_CTL_LINE 512
+#define RLM_BC_CTL_REPLY 2048
+#define RLM_BC_MAX_COLS 16
+#define RLM_BC_EVENT_USERS 4096 /* max. users tracked by event log rate limit */
+#define RLM_BC_EVENT_WAYS 4     /* users whose names hash to the same set */
+#define RLM_BC_EVENT_LINE 512
+#define RLM_BC_SQL_RETRY 5
+#define RLM_BC_MAX_DIMS 8
+
+#ifdef HAVE_PTHREAD_H
+#define BCNT_STAT_INC(data, field) __sync_fetch_and_add(&(data)->stats.field, 1)
+#define BCNT_STAT_ADD(data, field, n) __sync_fetch_and_add(&(data)->stats.field, (n))
+#else
+#define BCNT_STAT_INC(data, field) ((data)->stats.field++)
+#define BCNT_STAT_ADD(data, field, n) ((data)->stats.field += (n))
+#endif
+
+/* fixed slots of the accounting extraction plan */
+#define BCNT_SLOT_STATUS_TYPE  0
+#define BCNT_SLOT_SESSION_TIME 1
+#define BCNT_SLOT_DELAY_TIME   2
+#define BCNT_SLOT_FIXED        3
+
+/* query templates, see bcnt_query_defs */
+#define BCNT_Q_RESET           0
+#define BCNT_Q_LIMIT           1
+#define BCNT_Q_GROUP_LIMIT     2
+#define BCNT_Q_COUNTERS        3
+#define BCNT_Q_UPDATE          4
+#define BCNT_Q_TOPUP           5
+#define BCNT_Q_INSERT          6
+#define BCNT_Q_DUMP            7
+#define BCNT_Q_ROLLUP          8
+#define BCNT_Q_USER_GROUPS     9
+#define BCNT_Q_GROUP_VALUE    10
+#define BCNT_Q_CHARGE         11
+#define BCNT_Q_COUNT          12
 
 struct bcnt_level {
 	uint32_t   from;            /* UNIX timestamp reference point */
 	uint32_t   each;            /* number of seconds between repetitions */
 	uint32_t   length;          /* number of seconds of how long level lasts */
-	double     factor;          /* factor for count_names (see config file) */
+	int64_t    factor;          /* factor for count_names (see config file), fixed-point */
 	struct bcnt_level *next;    /* next on list */
 };
 
+struct bcnt_rollup {
+	uint32_t   period;          /* start of the rollup period (UNIX timestamp) */
+	int64_t    raw;             /* sum of count_names */
+	int64_t    weighted;        /* as above, multiplied by level factors */
+	int        tries;           /* failed flushes so far */
+	char       user[1];         /* user name (allocated together with struct) */
+};
+
+/* counters of one dimension fetched in authorize */
+struct bcnt_dim_state {
+	int64_t    left;            /* value of leftvap */
+	int64_t    prepaid;         /* value of prepaidvap */
+	int64_t    counter;         /* their sum, divided by current level factor */
+	int        has_left;        /* true if user has leftvap set */
+	int        has_prepaid;     /* true if user has prepaidvap set */
+};
+
+/* true if user has a limit in the dimension */
+#define BCNT_LIMITED(ds) ((ds)->has_left || (ds)->has_prepaid)
+
+/* counter state fetched in authorize, kept in request for the xlat */
+struct bcnt_state {
+	uint32_t   reset;           /* value of resetvap, 0 if not set */
+	struct bcnt_dim_state dims[1]; /* one for each dimension (allocated together) */
+};
+
+/* module statistics, shown on control socket */
+struct bcnt_stats {
+	unsigned long authorize;    /* authorize calls */
+	unsigned long accounting;   /* Accounting-Stop packets handled */
+	unsigned long resets;       /* counter resets */
+	unsigned long overlimit;    /* authorizations of users over limit */
+	unsigned long rejects;      /* as above, rejected */
+	unsigned long topups;       /* prepaid top-ups on control socket */
+	unsigned long db_errors;    /* failed queries */
+	unsigned long events;       /* lines written to event log */
+	unsigned long events_suppressed; /* events dropped by rate limit or write error */
+	unsigned long conn_gets;    /* database connections taken */
+	unsigned long conn_waits;   /* ...of which waited for 1 ms or more */
+	unsigned long conn_wait_us; /* total time spent waiting for connections */
+	unsigned long conn_wait_max_us; /* longest wait */
+	unsigned long sql_thread_socks; /* sockets opened for worker threads */
+	unsigned long sql_connects; /* connects of those sockets, incl. reconnects */
+	unsigned long sql_fallbacks; /* rlm_sql pool used as thread's socket was down */
+	unsigned long sql_health_checks; /* pings of idle thread sockets */
+	unsigned long sql_health_failures; /* ...which failed */
+	unsigned long rollups_dropped; /* rollup buckets not written, see bcnt_rollup_add() */
+};
+
+/* event log rate limit of a user */
+struct bcnt_event_user {
+	char       *user;           /* user name, NULL if unused */
+	time_t     window;          /* start of current interval */
+	int        count;           /* events logged in this interval */
+	int        suppressed;      /* events dropped since the last logged one */
+};
+
+/* database connection of a backend */
+struct bcnt_conn {
+	char       **row;           /* current row of select results */
+	int        result;          /* true if there are select results to free */
+	int        changes;         /* rows changed by last query */
+	SQLSOCK    *sqlsock;        /* "sql" backend: socket of rlm_sql */
+#ifdef HAVE_PTHREAD_H
+	/* "sql" backend with sql_thread_sockets: socket owned by a thread */
+	int        owned;           /* true if sqlsock is ours, not from the pool */
+	struct rlm_backcounter_t *data; /* instance the socket belongs to */
+	struct bcnt_conn **cell;    /* thread-specific pointer to this conn */
+	struct bcnt_conn *thread_next; /* next on data->sql_threads */
+	time_t     used;            /* last time socket was used or checked */
+	time_t     retry;           /* don't try to connect again before that */
+	unsigned   round;           /* last health check round that visited it */
+	int        checking;        /* true while health check uses it unlocked from the list */
+	int        orphan;          /* its thread exited during the check: health check frees it */
+	int        down;            /* a query found it dead, health check has to close it */
+	pthread_mutex_t mutex;      /* held by its thread or by health check */
+#endif
+#ifdef HAVE_SQLITE3
+	sqlite3    *db;             /* "sqlite" backend: database handle */
+	sqlite3_stmt *stmt;         /* current statement */
+	int        cached;          /* true if stmt is one of stmts, reset rather than finalized */
+	sqlite3_stmt *stmts[BCNT_Q_COUNT]; /* prepared query templates, see sqlite_sql */
+	char       *cols[RLM_BC_MAX_COLS]; /* current row */
+	struct bcnt_conn *next;     /* next idle connection */
+#endif
+};
+
+/* piece of a compiled query template: literal text or a placeholder */
+struct bcnt_seg {
+	const char *text;           /* literal text (not terminated), NULL for placeholder */
+	size_t     len;             /* length of text */
+	char       param;           /* placeholder letter, eg. 'u' for user name */
+};
+
+/* query template, compiled on instantiate */
+struct bcnt_tpl {
+	const char *name;           /* config item, for log messages */
+	int        count;           /* number of segs */
+	struct bcnt_seg segs[1];    /* allocated together with struct */
+};
+
+/* values of query template placeholders */
+struct bcnt_args {
+	const char *user;           /* %u */
+	const char *group;          /* %g */
+	const char *attr;           /* %a */
+	const char *value;          /* %v */
+	const char *rows;           /* %R */
+};
+
+/* cached query result */
+struct bcnt_cache_entry {
+	const char *key;            /* points to buf */
+	const char *value;          /* points to buf after key, NULL if cached as not found */
+	size_t     len;             /* length of value */
+	time_t     expires;         /* when the entry gets stale */
+	char       buf[1];          /* key and value (allocated together with struct) */
+};
+
+/* TTL cache of query results, shared by threads */
+struct bcnt_cache {
+	const char *name;           /* for log messages */
+	fr_hash_table_t *ht;        /* struct bcnt_cache_entry, NULL if disabled */
+	int ttl;                    /* lifetime of entries, in seconds */
+	int size;                   /* max. number of entries */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long flushes;      /* times the cache was emptied because it was full */
+	unsigned long evictions;    /* entries dropped by the above */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t mutex;
+#endif
+};
+
+struct bcnt_count {
+	int attr;                   /* attribute to count */
+	int slot;                   /* its slot in the extraction plan */
+	int giga;                   /* slot of matching Gigawords attribute, or -1 */
+};
+
+/* counter dimension, eg. octets or time; the main one is configured at module level */
+struct bcnt_dim {
+	const char *name;           /* "main" or name of dimension subsection */
+
+	char *count_names;          /* attributes to count values of, sep with "," */
+	struct bcnt_count *count_attrs; /* as above, parsed; attr == 0 ends the array */
+
+	char *guardvap;             /* attribute to set to current counters sum
+	                               ie. it should make the NAS close user session
+	                               when necessary, not to exceed the limits */
+	int guardvap_attr;          /* int value of guardvap */
+	char *giga_guardvap;        /* same as guardvap but counts 4 gigas (2^32) */
+	int giga_guardvap_attr;     /* int value of giga_guardvap */
+
+	/* from database - VAP names */
+	char *leftvap;              /* current user counter state (the main counter) */
+	char *limitvap;             /* the amount to add to db_left on counter reset */
+	char *prepaidvap;           /* the prepaid counter (we can only decrease it); may be "" */
+};
+
 typedef struct rlm_backcounter_t {
 	const char *myname;         /* name of this instance */
+	const char *xlat_name;      /* name of xlat registered for this instance */
+
+	/* storage */
+	const struct bcnt_backend *backend; /* where counters are kept */
+	struct bcnt_tpl *tpl[BCNT_Q_COUNT]; /* compiled query templates */
+	int backend_ready;          /* true if backend->init() succeeded */
+
+	/* "sql" backend */
 	SQL_INST *sqlinst;          /* SQL_INST for requested instance */
 	rlm_sql_module_t *db;       /* here the fun takes place ;-) */
+	int sql_thread_sockets;     /* if true each thread has its own socket */
+	int sql_health_interval;    /* ping thread sockets idle that long, 0 disables */
+	char *sql_health_query;     /* query used for the ping */
+	struct bcnt_conn *sql_conns; /* one for each socket of the rlm_sql pool, by id */
+	int sql_conns_count;
+#ifdef HAVE_PTHREAD_H
+	pthread_key_t sql_key;      /* thread's struct bcnt_conn ** */
+	int sql_key_ready;          /* true if sql_key is created */
+	struct bcnt_conn *sql_threads; /* sockets of all threads */
+	int sql_threads_count;      /* sockets created so far, for their ids */
+	int sql_health_running;     /* true if sql_health_thread is started */
+	unsigned sql_health_round;  /* number of bcnt_sql_health() runs */
+	int sql_pipe[2];            /* pipe to wake up sql_health_thread on detach */
+	pthread_t sql_health_thread;
+#endif
+
+	/* "sqlite" backend */
+	char *sqlite_file;          /* path to database file */
+
+	/* caches */
+	int group_cache_ttl;        /* group -> limitvap cache lifetime, 0 disables */
+	int user_group_cache_ttl;   /* user -> groups cache lifetime, 0 disables */
+	int overlimit_cache_ttl;    /* user -> over limit decision lifetime, 0 disables */
+	int cache_size;             /* max. entries in each cache */
+	struct bcnt_cache group_limits;
+	struct bcnt_cache user_groups;
+	struct bcnt_cache overlimit; /* struct bcnt_state of users over limit */
+
+	/* query templates, "" for backend's default */
+	char *query_text[BCNT_Q_COUNT];
+#ifdef HAVE_SQLITE3
+	char *sqlite_sql[BCNT_Q_COUNT]; /* templates with SQL parameters, NULL if not possible */
+	struct bcnt_conn *sqlite_free; /* idle connections */
+	int sqlite_ready;           /* true if sqlite_mutex is initialized */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t sqlite_mutex;
+#endif
+#endif
 
 	/* from config */
+	char *backend_name;         /* "sql" or "sqlite" */
 	char *sqlinst_name;         /* rlm_sql instance to use */
 	int period;                 /* leftvap counter reset period, in seconds */
 	int prepaidfirst;           /* if true prepaidvap is be decreased first */
 	int noreset;                /* if true don't do any counter resets */
 
-	char *count_names;          /* attributes to count values of, sep with "," */
-	int *count_attrs;           /* as above, int values */
+	/* counter dimensions; dims[0] is main */
+	struct bcnt_dim main;
+	struct bcnt_dim **dims;
+	int dims_count;
+	char *all_counters;         /* quoted leftvaps and prepaidvaps of all dimensions */
+	char *all_limits;           /* quoted limitvaps of all dimensions */
+
+	/* accounting extraction plan: attribute number of each slot */
+	int plan[RLM_BC_MAX_SLOTS];
+	int plan_len;
 
 	char *overvap;              /* add this VAP to *request* if user has exceeded
 	                               his limits; if null, then reject access */
 	int overvap_attr;           /* int value of overvap */
 
-	char *guardvap;             /* attribute to set to current counters sum
-	                               ie. it should make the NAS close user session
-	                               when necessary, not to exceed the limits */
-	int guardvap_attr;          /* int value of guardvap */
-	char *giga_guardvap;        /* same as guardvap but counts 4 gigas (2^32) */
-	int giga_guardvap_attr;     /* int value of giga_guardvap */
-
-	/* from database - VAP names */
-	char *leftvap;              /* current user counter state (the main counter) */
-	char *limitvap;             /* the amount to add to db_left on counter reset */
-	char *resetvap;             /* next counter reset time */
-	char *prepaidvap;           /* the prepaid counter (we can only decrease it) */
+	char *resetvap;             /* next counter reset time, common to all dimensions */
 
 	/* time-dependent levels */
 	char *levels_str;           /* string representation of levels */
 	struct bcnt_level *levels;  /* parsed levels_str */
+
+	/* hourly usage rollup */
+	char *rollup_table;         /* table to flush rollups to; if empty, disabled */
+	int rollup_interval;        /* flush every that many seconds */
+	int rollup_size;            /* flush earlier if that many buckets are pending */
+	fr_hash_table_t *rollup;    /* pending struct bcnt_rollup buckets */
+	time_t rollup_flushed;      /* time of last flush */
+	int rollup_flushing;        /* true if some thread is flushing right now */
+	int rollup_running;         /* true if rollup_thread is started */
+	int rollup_woken;           /* true if rollup_thread was asked to flush */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t rollup_mutex;
+	int rollup_pipe[2];         /* pipe to wake up rollup_thread to flush or on detach */
+	pthread_t rollup_thread;    /* thread flushing rollups when there's no traffic */
+#endif
+
+	/* control socket */
+	char *control_socket;       /* path to unix socket; if empty, disabled */
+	int ctl_fd;                 /* listening socket, -1 if not open */
+	ino_t ctl_ino;              /* inode of control_socket we've created */
+#ifdef HAVE_PTHREAD_H
+	int ctl_pipe[2];            /* pipe to wake up ctl_thread on detach */
+	pthread_t ctl_thread;       /* thread serving the control socket */
+#endif
+
+	/* schema verification */
+	char *schema_check;         /* "no", "warn" or "fail" on full table scans */
+	int schema_indexes;         /* if true, create missing indexes */
+
+	/* event log */
+	char *event_log;            /* path to file; if empty, disabled */
+	int event_log_burst;        /* max. events of user per event_log_interval */
+	int event_log_interval;     /* in seconds */
+	int event_fd;               /* -1 if not open */
+	struct bcnt_event_user *event_users; /* RLM_BC_EVENT_USERS, in sets of RLM_BC_EVENT_WAYS */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t event_mutex;
+#endif
+
+	struct bcnt_stats stats;
 } rlm_backcounter_t;
 
+/* where the counters are kept; see the "sql" and "sqlite" backends below */
+struct bcnt_backend {
+	const char *name;
+	const char **queries;       /* default query templates, in order of BCNT_Q_* */
+
+	/* returns 0 on error, after freeing what it has set up; detach is called
+	 * only if init succeeded */
+	int  (*init)(rlm_backcounter_t *data);
+	void (*detach)(rlm_backcounter_t *data);
+
+	/* returns NULL on error */
+	struct bcnt_conn *(*get)(rlm_backcounter_t *data);
+	void (*release)(rlm_backcounter_t *data, struct bcnt_conn *conn);
+
+	/* returns 0 on error */
+	int  (*query)(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query);
+	/* see bcnt_select() and bcnt_select_next() */
+	int  (*select)(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query);
+	int  (*next)(rlm_backcounter_t *data, struct bcnt_conn *conn);
+	void (*finish)(rlm_backcounter_t *data, struct bcnt_conn *conn);
+
+	int  (*affected_rows)(rlm_backcounter_t *data, struct bcnt_conn *conn);
+	const char *(*error)(rlm_backcounter_t *data, struct bcnt_conn *conn);
+	/* see bcnt_sql_explain() */
+	int  (*explain)(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *site,
+	                const char *query, char *table, size_t tablelen);
+
+	/* optional: like query and select, but for template q with values bound rather than
+	 * rendered into the query; return -2 if the template can't be run that way */
+	int  (*tpl_query)(rlm_backcounter_t *data, struct bcnt_conn *conn, int q,
+	                  const struct bcnt_args *args);
+	int  (*tpl_select)(rlm_backcounter_t *data, struct bcnt_conn *conn, int q,
+	                   const struct bcnt_args *args);
+};
+
 /* char *name, int type,
  * size_t offset, void *data, char *dflt */
 static CONF_PARSER module_config[] = {
+	{ "backend",       PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, backend_name),  NULL, "sql" },
 	{ "sqlinst_name",  PW_TYPE_STRING_PTR,
 	  offsetof(rlm_backcounter_t, sqlinst_name),  NULL, "sql" },
+	{ "sql_thread_sockets", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_backcounter_t, sql_thread_sockets), NULL, "no" },
+	{ "sql_health_interval", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, sql_health_interval), NULL, "30" },
+	{ "sql_health_query", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, sql_health_query), NULL, "SELECT 1" },
+	{ "sqlite_file",   PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, sqlite_file),   NULL, "" },
+	{ "reset_query",   PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_RESET]),       NULL, "" },
+	{ "limit_query",   PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_LIMIT]),       NULL, "" },
+	{ "group_limit_query", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_GROUP_LIMIT]), NULL, "" },
+	{ "counters_query", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_COUNTERS]),    NULL, "" },
+	{ "update_query",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_UPDATE]),      NULL, "" },
+	{ "topup_query",   PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_TOPUP]),       NULL, "" },
+	{ "charge_query",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_CHARGE]),      NULL, "" },
+	{ "insert_query",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_INSERT]),      NULL, "" },
+	{ "dump_query",    PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_DUMP]),        NULL, "" },
+	{ "rollup_query",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_ROLLUP]),      NULL, "" },
+	{ "user_groups_query", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_USER_GROUPS]), NULL, "" },
+	{ "group_value_query", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, query_text[BCNT_Q_GROUP_VALUE]), NULL, "" },
+	{ "group_cache_ttl", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, group_cache_ttl), NULL, "0" },
+	{ "user_group_cache_ttl", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, user_group_cache_ttl), NULL, "0" },
+	{ "overlimit_cache_ttl", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, overlimit_cache_ttl), NULL, "0" },
+	{ "cache_size",    PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, cache_size),    NULL, "100000" },
 	{ "period",        PW_TYPE_INTEGER,
 	  offsetof(rlm_backcounter_t, period),        NULL, "2592000" },  /* default: 30 days */
 	{ "prepaidfirst",  PW_TYPE_BOOLEAN,
@@ -104,23 +491,58 @@ static CONF_PARSER module_config[] = {
 	{ "noreset",       PW_TYPE_BOOLEAN,
 	  offsetof(rlm_backcounter_t, noreset),       NULL, "no" },
 	{ "count_names",   PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, count_names),   NULL, "Acct-Input-Octets, Acct-Output-Octets" },
+	  offsetof(rlm_backcounter_t, main.count_names), NULL, "Acct-Input-Octets, Acct-Output-Octets" },
 	{ "overvap",       PW_TYPE_STRING_PTR,
 	  offsetof(rlm_backcounter_t, overvap),       NULL, "Counter-Exceeded" },
 	{ "guardvap",      PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, guardvap),      NULL, "Session-Octets-Limit" },
+	  offsetof(rlm_backcounter_t, main.guardvap), NULL, "Session-Octets-Limit" },
 	{ "giga_guardvap", PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, giga_guardvap), NULL, "" },
+	  offsetof(rlm_backcounter_t, main.giga_guardvap), NULL, "" },
 	{ "leftvap",       PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, leftvap),       NULL, "Counter-Left" },
+	  offsetof(rlm_backcounter_t, main.leftvap),  NULL, "Counter-Left" },
 	{ "limitvap",      PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, limitvap),      NULL, "Counter-Limit" },
+	  offsetof(rlm_backcounter_t, main.limitvap), NULL, "Counter-Limit" },
 	{ "resetvap",      PW_TYPE_STRING_PTR,
 	  offsetof(rlm_backcounter_t, resetvap),      NULL, "Counter-Reset" },
 	{ "prepaidvap",    PW_TYPE_STRING_PTR,
-	  offsetof(rlm_backcounter_t, prepaidvap),    NULL, "Counter-Prepaid" },
+	  offsetof(rlm_backcounter_t, main.prepaidvap), NULL, "Counter-Prepaid" },
 	{ "levels",        PW_TYPE_STRING_PTR,
 	  offsetof(rlm_backcounter_t, levels_str),    NULL, "" },
+	{ "rollup_table",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, rollup_table),  NULL, "" },
+	{ "rollup_interval", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, rollup_interval), NULL, "60" },
+	{ "rollup_size",   PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, rollup_size),   NULL, "10000" },
+	{ "control_socket", PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, control_socket), NULL, "" },
+	{ "schema_check",  PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, schema_check),  NULL, "no" },
+	{ "schema_indexes", PW_TYPE_BOOLEAN,
+	  offsetof(rlm_backcounter_t, schema_indexes), NULL, "no" },
+	{ "event_log",     PW_TYPE_STRING_PTR,
+	  offsetof(rlm_backcounter_t, event_log),     NULL, "" },
+	{ "event_log_burst", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, event_log_burst), NULL, "5" },
+	{ "event_log_interval", PW_TYPE_INTEGER,
+	  offsetof(rlm_backcounter_t, event_log_interval), NULL, "60" },
+	{ NULL, -1, 0, NULL, NULL } /* end */
+};
+
+/* "dimension <name> { }" subsections; see struct bcnt_dim */
+static CONF_PARSER dimension_config[] = {
+	{ "count_names",   PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, count_names),   NULL, "" },
+	{ "guardvap",      PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, guardvap),      NULL, "" },
+	{ "giga_guardvap", PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, giga_guardvap), NULL, "" },
+	{ "leftvap",       PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, leftvap),       NULL, "" },
+	{ "limitvap",      PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, limitvap),      NULL, "" },
+	{ "prepaidvap",    PW_TYPE_STRING_PTR,
+	  offsetof(struct bcnt_dim, prepaidvap),    NULL, "" },
 	{ NULL, -1, 0, NULL, NULL } /* end */
 };
 
@@ -133,7 +555,7 @@ struct lp_data {
 		LK_END
 	} keyword;
 	int32_t value_int;
-	double  value_double;
+	int64_t value_fixed;
 	char    *next;
 };
 
@@ -187,7 +609,7 @@ static int bcnt_levels_parser(char *ptr, struct lp_data *lp)
 		ptr++;
 
 	lp->value_int = atol(val);
-	lp->value_double = strtod(val, (char **) NULL);
+	lp->value_fixed = bcnt_fixed(val);
 
 	if (*ptr)
 		lp->next = ptr;
@@ -249,7 +671,8 @@ level_search:
 	return level;
 }
 
-/** Wrapper around radlog which adds prefix with module and instance name */
+/** Wrapper around radlog which adds prefix with module and instance name;
+ * use bcnt_log(), which drops disabled levels before any formatting */
 static int bcnt_log_detailed(int lvl, const char *file, unsigned int line, const char *fnname,
 	rlm_backcounter_t *data, const char *fmt, ...)
 {
@@ -266,43 +689,331 @@ static int bcnt_log_detailed(int lvl, const char *file, unsigned int line, const
 
 	return r;
 }
-#define bcnt_log(lvl, ...) bcnt_log_detailed((lvl), __FILE__, __LINE__, __func__, data, __VA_ARGS__)
 
-/** Handy SQL query tool */
-static int bcnt_vquery(unsigned int line, rlm_backcounter_t *data,
-                       SQLSOCK *sqlsock, const char *fmt, va_list ap)
+/* radlog() drops debug messages unless debugging, so don't even format them;
+ * with RLM_BC_NO_DEBUG they are not compiled in at all */
+#ifdef RLM_BC_NO_DEBUG
+#define BCNT_LOG_ON(lvl) ((lvl) != L_DBG)
+#else
+#define BCNT_LOG_ON(lvl) ((lvl) != L_DBG || debug_flag)
+#endif
+
+#define bcnt_log(lvl, ...) do { \
+	if (BCNT_LOG_ON(lvl)) \
+		bcnt_log_detailed((lvl), __FILE__, __LINE__, __func__, data, __VA_ARGS__); \
+} while (0)
+
+/** Finds rate limit of user, or takes one for them; caller must hold event_mutex
+ * A user gets the unused or least recent entry of the set their name hashes
+ * to, unless all of the set are still counting events in their interval.
+ * @param add              take an entry if there's none
+ * @return NULL if the user can't be tracked now */
+static struct bcnt_event_user *bcnt_event_user(rlm_backcounter_t *data, const char *user,
+                                               time_t now, int add)
 {
-	char query[MAX_QUERY_LEN];
+	struct bcnt_event_user *set, *eu, *victim = NULL;
+	int i;
 
-	vsnprintf(query, MAX_QUERY_LEN, fmt, ap);
+	set = &data->event_users[(fr_hash_string(user) % (RLM_BC_EVENT_USERS / RLM_BC_EVENT_WAYS)) *
+	                         RLM_BC_EVENT_WAYS];
+
+	for (i = 0; i < RLM_BC_EVENT_WAYS; i++) {
+		eu = &set[i];
+		if (eu->user && strcmp(eu->user, user) == 0)
+			return eu;
+
+		if (!victim || !eu->user || (victim->user && eu->window < victim->window))
+			victim = eu;
+	}
+
+	if (!add || (victim->user && now - victim->window < data->event_log_interval))
+		return NULL;
+
+	if (victim->user)
+		free(victim->user);
+
+	victim->user = strdup(user);
+	if (!victim->user)
+		return NULL;
+
+	victim->window     = now;
+	victim->count      = 0;
+	victim->suppressed = 0;
+
+	return victim;
+}
+
+/** Appends line with user's event to the event log
+ * @param limited          drop the event if the user has already logged
+ *                         event_log_burst events in this event_log_interval
+ * @param fmt              more "key=value" fields, or NULL */
+static void bcnt_event(rlm_backcounter_t *data, const char *event, const char *user, int limited,
+                       const char *fmt, ...)
+{
+	struct bcnt_event_user *eu;
+	char line[RLM_BC_EVENT_LINE];
+	const unsigned char *p;
+	time_t now;
+	int len, suppressed = 0;
+	va_list ap;
+
+	if (data->event_fd < 0)
+		return;
+
+	/* check the limit before formatting anything */
+	now = time(NULL);
+
+	pthread_mutex_lock(&data->event_mutex);
+
+	/* events which aren't limited don't count either; limited ones of users
+	 * who can't be tracked now are dropped, as they come in a storm */
+	eu = bcnt_event_user(data, user, now, limited);
+	if (!eu && limited) {
+		pthread_mutex_unlock(&data->event_mutex);
+		BCNT_STAT_INC(data, events_suppressed);
+		return;
+	}
+
+	if (eu && limited) {
+		if (now - eu->window >= data->event_log_interval) {
+			eu->window = now;
+			eu->count  = 0;
+		}
+
+		if (eu->count >= data->event_log_burst) {
+			eu->suppressed++;
+			pthread_mutex_unlock(&data->event_mutex);
+			BCNT_STAT_INC(data, events_suppressed);
+			return;
+		}
+
+		eu->count++;
+	}
+	if (eu) {
+		suppressed = eu->suppressed;
+		eu->suppressed = 0;
+	}
+
+	pthread_mutex_unlock(&data->event_mutex);
+
+	len = snprintf(line, sizeof(line), "%lu %s event=%s user=\"",
+	               (unsigned long) now, data->myname, event);
+
+	/* quote user name, so it can't fake other fields or lines */
+	for (p = (const unsigned char *) user; *p && len < (int) sizeof(line) - 4; p++) {
+		if (*p == '"' || *p == '\\')
+			line[len++] = '\\';
+		line[len++] = (*p < 0x20 || *p == 0x7f) ? '?' : *p;
+	}
+	line[len++] = '"';
+
+	if (suppressed)
+		len += snprintf(line + len, sizeof(line) - len, " suppressed=%d", suppressed);
+
+	if (fmt && len < (int) sizeof(line) - 1) {
+		line[len++] = ' ';
+
+		va_start(ap, fmt);
+		len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+		va_end(ap);
+	}
+
+	if (len > (int) sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	line[len++] = '\n';
+
+	/* single write() to a file opened with O_APPEND, so lines of threads don't mix */
+	if (write(data->event_fd, line, len) < 0) {
+		BCNT_STAT_INC(data, events_suppressed);
+		return;
+	}
+
+	BCNT_STAT_INC(data, events);
+}
+
+/** Find or add attribute slot in the extraction plan
+ * @retval -1  plan is full */
+static int bcnt_plan_slot(rlm_backcounter_t *data, int attr)
+{
+	int i;
+
+	for (i = 0; i < data->plan_len; i++)
+		if (data->plan[i] == attr)
+			return i;
+
+	if (data->plan_len == RLM_BC_MAX_SLOTS)
+		return -1;
+
+	data->plan[data->plan_len] = attr;
+	return data->plan_len++;
+}
+
+/** Collect all attributes needed in accounting in a single walk over vps
+ * @param slots            array of RLM_BC_MAX_SLOTS, first VP found for each slot */
+static void bcnt_plan_extract(rlm_backcounter_t *data, VALUE_PAIR *vps, VALUE_PAIR **slots)
+{
+	VALUE_PAIR *vp;
+	int i, found = 0;
+
+	memset(slots, 0, sizeof(VALUE_PAIR *) * RLM_BC_MAX_SLOTS);
+
+	for (vp = vps; vp && found < data->plan_len; vp = vp->next) {
+		for (i = 0; i < data->plan_len; i++) {
+			if (data->plan[i] != vp->attribute)
+				continue;
+
+			/* first one wins, like in pairfind() */
+			if (!slots[i]) {
+				slots[i] = vp;
+				found++;
+			}
+			break;
+		}
+	}
+}
 
-	if (rlm_sql_query(sqlsock, data->sqlinst, query)) {
-		bcnt_log(L_ERR, "query from line %u: %s",
-		         line, (const char *)(data->db->sql_error)(sqlsock, data->sqlinst->config));
+/** Read numeric value of VP, checking its type
+ * @retval 0   also if the VP is not numeric */
+static uint64_t bcnt_vp_value(rlm_backcounter_t *data, VALUE_PAIR *vp)
+{
+	switch (vp->type) {
+		case PW_TYPE_INTEGER:
+		case PW_TYPE_DATE:
+			return vp->vp_integer;
+#ifdef PW_TYPE_INTEGER64
+		case PW_TYPE_INTEGER64:
+			return vp->vp_integer64;
+#endif
+		default:
+			bcnt_log(L_ERR, "attribute %s is not of integer type - ignoring it", vp->name);
+			return 0;
+	}
+}
+
+/** Value of counted attribute, including the matching Gigawords attribute */
+static uint64_t bcnt_count_value(rlm_backcounter_t *data, struct bcnt_count *cnt, VALUE_PAIR **slots)
+{
+	VALUE_PAIR *vp = slots[cnt->slot];
+	uint64_t val;
+
+	val = bcnt_vp_value(data, vp);
+
+	/* 64-bit attributes carry their higher bits already */
+	if (cnt->giga >= 0 && slots[cnt->giga] && vp->type == PW_TYPE_INTEGER)
+		val |= bcnt_vp_value(data, slots[cnt->giga]) << 32;
+
+	return val;
+}
+
+/** Gets database connection from backend */
+static struct bcnt_conn *bcnt_conn_get(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+	struct timeval start, end;
+	long us;
+
+	gettimeofday(&start, NULL);
+	conn = (data->backend->get)(data);
+	gettimeofday(&end, NULL);
+
+	/* time spent in pool or on connection lock */
+	us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+	if (us < 0)
+		us = 0;
+
+	BCNT_STAT_INC(data, conn_gets);
+	BCNT_STAT_ADD(data, conn_wait_us, us);
+	if (us >= 1000)
+		BCNT_STAT_INC(data, conn_waits);
+
+	/* racy, but it's just a statistic */
+	if ((unsigned long) us > data->stats.conn_wait_max_us)
+		data->stats.conn_wait_max_us = us;
+
+	if (!conn)
+		bcnt_log(L_ERR, "couldn't get a database connection");
+
+	return conn;
+}
+
+/** Returns database connection to backend */
+static void bcnt_conn_release(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	(data->backend->release)(data, conn);
+}
+
+/** Logs database error of query from given line */
+static void bcnt_db_error(unsigned int line, rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	BCNT_STAT_INC(data, db_errors);
+	bcnt_log(L_ERR, "query from line %u: %s",
+	         line, (data->backend->error)(data, conn));
+}
+
+/** Runs query, logging errors */
+static int bcnt_exec(unsigned int line, rlm_backcounter_t *data,
+                     struct bcnt_conn *conn, char *query)
+{
+	if (!(data->backend->query)(data, conn, query)) {
+		bcnt_db_error(line, data, conn);
 		return 0;
 	}
 
 	return 1;
 }
 
+/** Handy SQL query tool */
+static int bcnt_vquery(unsigned int line, rlm_backcounter_t *data,
+                       struct bcnt_conn *conn, const char *fmt, va_list ap)
+{
+	char query[MAX_QUERY_LEN];
+
+	vsnprintf(query, MAX_QUERY_LEN, fmt, ap);
+	return bcnt_exec(line, data, conn, query);
+}
+
 /** Wrapper around bcnt_vquery */
 static int bcnt_query(unsigned int line, rlm_backcounter_t *data,
-                     SQLSOCK *sqlsock, const char *fmt, ...)
+                     struct bcnt_conn *conn, const char *fmt, ...)
 {
 	int r;
 	va_list ap;
 
 	va_start(ap, fmt);
-	r = bcnt_vquery(line, data, sqlsock, fmt, ap);
+	r = bcnt_vquery(line, data, conn, fmt, ap);
 	va_end(ap);
 
 	return r;
 }
 
-/** Handy wrapper around data->db->sql_finish_query() */
-static int bcnt_finish(rlm_backcounter_t *data, SQLSOCK *sqlsock)
+/** Finishes query or frees select results */
+static void bcnt_finish(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	(data->backend->finish)(data, conn);
+}
+#define bcnt_select_finish bcnt_finish
+
+/** Logs result of select query from given line; see bcnt_select() */
+static int bcnt_fetched(unsigned int line, rlm_backcounter_t *data,
+                        struct bcnt_conn *conn, int r)
+{
+	switch (r) {
+		case -1:
+			bcnt_log(L_DBG, "no results in query from line %u", line);
+			break;
+		case 0:
+			bcnt_db_error(line, data, conn);
+			break;
+	}
+
+	return r;
+}
+
+/** Executes select query and fetches first row; see bcnt_select() */
+static int bcnt_fetch(unsigned int line, rlm_backcounter_t *data,
+                      struct bcnt_conn *conn, char *query)
 {
-	return (data->db->sql_finish_query)(sqlsock, data->sqlinst->config);
+	return bcnt_fetched(line, data, conn, (data->backend->select)(data, conn, query));
 }
 
 /** Executes query and fetches first row
@@ -312,196 +1023,3186 @@ static int bcnt_finish(rlm_backcounter_t *data, SQLSOCK *sqlsock)
  * @retval  1 success
  */
 static int bcnt_select(unsigned int line, rlm_backcounter_t *data,
-                       SQLSOCK *sqlsock, const char *fmt, ...)
+                       struct bcnt_conn *conn, const char *fmt, ...)
 {
 	va_list ap;
+	char query[MAX_QUERY_LEN];
 
 	va_start(ap, fmt);
-	if (!bcnt_vquery(line, data, sqlsock, fmt, ap)) {
-		va_end(ap);
-		return 0;
-	}
+	vsnprintf(query, MAX_QUERY_LEN, fmt, ap);
 	va_end(ap);
 
-	if ((data->db->sql_store_result)(sqlsock, data->sqlinst->config)) {
-		bcnt_log(L_ERR, "error while saving results of query from line %u", line);
-		return 0;
-	}
-
-	if ((data->db->sql_num_rows)(sqlsock, data->sqlinst->config) < 1) {
-		bcnt_log(L_DBG, "no results in query from line %u", line);
-		return -1;
-	}
-
-	if ((data->db->sql_fetch_row)(sqlsock, data->sqlinst->config)) {
-		bcnt_log(L_ERR, "couldn't fetch row from results of query from line %u", line);
-		return 0;
-	}
-
-	return 1;
+	return bcnt_fetch(line, data, conn, query);
 }
 
-/** Frees select results */
-static int bcnt_select_finish(rlm_backcounter_t *data, SQLSOCK *sqlsock)
+/** Fetches next row of select results
+ * @retval 0   no more rows or db error
+ * @retval 1   success */
+static int bcnt_select_next(rlm_backcounter_t *data, struct bcnt_conn *conn)
 {
-	return ((data->db->sql_free_result)(sqlsock, data->sqlinst->config) ||
-	         bcnt_finish(data, sqlsock));
+	return (data->backend->next)(data, conn);
 }
 
+/* query templates, in order of BCNT_Q_* */
+static const struct bcnt_query_def {
+	const char *name;           /* config item */
+	const char *params;         /* placeholders allowed besides %l, %p, %m, %r, %t, %A and %M */
+	const char *needed;         /* placeholders which must be used */
+} bcnt_query_defs[BCNT_Q_COUNT] = {
+	{ "reset_query",       "ua",  "u"  },
+	{ "limit_query",       "ua",  "u"  },
+	{ "group_limit_query", "ua",  "u"  },
+	{ "counters_query",    "u",   "u"  },
+	{ "update_query",      "uav", "uv" },
+	{ "topup_query",       "uav", "uv" },
+	{ "insert_query",      "uav", "uv" },
+	{ "dump_query",        "u",   "u"  },
+	{ "rollup_query",      "R",   "R"  },
+	{ "user_groups_query", "u",   "u"  },
+	{ "group_value_query", "ga",  "g"  },
+	{ "charge_query",      "uav", "uv" }
+};
 
-/** Cleanup stuff */
-static int backcounter_detach(void *instance)
+/** Appends segment to query template */
+static void bcnt_tpl_add(struct bcnt_tpl *tpl, const char *text, size_t len, char param)
 {
-	rlm_backcounter_t *data;
-	struct bcnt_level *level, *next_level;
+	struct bcnt_seg *seg;
 
-	if (instance == NULL)
-		return 0;
-
-	data = (rlm_backcounter_t *) instance;
+	/* skip empty literals */
+	if (text && !len)
+		return;
 
-	/* (*data) is zeroed on instantiation */
-	if (data->sqlinst_name)  free(data->sqlinst_name);
-	if (data->count_names)   free(data->count_names);
-	if (data->count_attrs)   free(data->count_attrs);
-	if (data->leftvap)       free(data->leftvap);
-	if (data->limitvap)      free(data->limitvap);
-	if (data->resetvap)      free(data->resetvap);
-	if (data->prepaidvap)    free(data->prepaidvap);
-	if (data->overvap)       free(data->overvap);
-	if (data->guardvap)      free(data->guardvap);
-	if (data->giga_guardvap) free(data->giga_guardvap);
+	seg = &tpl->segs[tpl->count++];
+	seg->text  = text;
+	seg->len   = len;
+	seg->param = param;
+}
 
-	/* free levels */
-	level = data->levels;
-	while (level) {
-		next_level = level->next;
-		free(level);
-		level = next_level;
-	}
+/** Checks if template contains placeholder */
+static int bcnt_tpl_uses(const struct bcnt_tpl *tpl, char param)
+{
+	int i;
 
-	free(data);
+	for (i = 0; i < tpl->count; i++)
+		if (tpl->segs[i].param == param)
+			return 1;
 
 	return 0;
 }
 
-/** Does initialization */
-static int backcounter_instantiate(CONF_SECTION *conf, void **instance)
+/** Parses query template into literal text and placeholder segments
+ * @param text             template; must stay allocated while the result is used
+ * @return NULL on error */
+static struct bcnt_tpl *bcnt_tpl_compile(rlm_backcounter_t *data, int q, const char *text)
 {
-	rlm_backcounter_t *data;
-	module_instance_t *modinst;
-	int i, c, l, a;
-	struct bcnt_level *last = NULL, *level;
-	DICT_ATTR *dattr;
-	struct lp_data lp;
-
-	/* set up a storage area for instance data */
-	data = rad_malloc(sizeof(*data));
-	if (!data) return -1;
-	memset(data, 0, sizeof(*data)); /* so backcounter_detach will know what to free */
-
-	/* fail if the configuration parameters can't be parsed */
-	if (cf_section_parse(conf, data, module_config) < 0) {
-		backcounter_detach(*instance);
-		return -1;
-	}
+	const struct bcnt_query_def *def = &bcnt_query_defs[q];
+	struct bcnt_tpl *tpl;
+	const char *p, *lit;
+	int n = 0;
+
+	/* each % adds at most a placeholder and the literal after it */
+	for (p = text; *p; p++)
+		if (*p == '%')
+			n++;
+
+	tpl = rad_malloc(sizeof(*tpl) + sizeof(struct bcnt_seg) * 2 * n);
+	tpl->name  = def->name;
+	tpl->count = 0;
+
+	for (p = lit = text; *p; p++) {
+		if (*p != '%')
+			continue;
 
-	/* save my name */
-	data->myname = cf_section_name2(conf);
-	if (!data->myname)
-		data->myname = "(no name)";
+		/* "%%" is a literal "%" */
+		if (p[1] == '%') {
+			bcnt_tpl_add(tpl, lit, p + 1 - lit, 0);
+			lit = ++p + 1;
+			continue;
+		}
 
-	modinst = find_module_instance(cf_section_find("modules"), (data->sqlinst_name), 1 );
-	if (!modinst) {
-		bcnt_log(L_ERR, "cannot find module instance named \"%s\"", data->sqlinst_name);
-		backcounter_detach(*instance);
-		return -1;
-	}
+		if (!p[1] || (!strchr(def->params, p[1]) && !strchr("lpmrtAM", p[1]))) {
+			bcnt_log(L_ERR, "%s: invalid placeholder \"%%%.1s\"", def->name, p + 1);
+			free(tpl);
+			return NULL;
+		}
 
-	/* check if the given instance is really a rlm_sql instance */
-	if (strcmp(modinst->entry->name, "rlm_sql") != 0) {
-		bcnt_log(L_ERR, "given instance (%s) is not an instance of the rlm_sql module", data->sqlinst_name);
-		backcounter_detach(*instance);
-		return -1;
+		bcnt_tpl_add(tpl, lit, p - lit, 0);
+		bcnt_tpl_add(tpl, NULL, 0, p[1]);
+		lit = ++p + 1;
 	}
+	bcnt_tpl_add(tpl, lit, p - lit, 0);
 
-	/* convert count_names to attributes */
-	c = 1;
-	l = strlen(data->count_names);
-
-	/* convert commas and spaces to \0, count number of attributes in c */
-	for (i = 0; i < l; i++) {
-		if (data->count_names[i] == ',' || data->count_names[i] == ' ') {
-			c++;
-			while (i < l && (data->count_names[i] < 'A' || data->count_names[i] > 'Z'))
-				data->count_names[i++] = '\0';
+	for (p = def->needed; *p; p++) {
+		if (!bcnt_tpl_uses(tpl, *p)) {
+			bcnt_log(L_ERR, "%s: must contain %%%c", def->name, *p);
+			free(tpl);
+			return NULL;
+		}
+	}
+
+	return tpl;
+}
+
+/** Returns value of placeholder which is the same for all queries of the instance */
+static const char *bcnt_tpl_const(rlm_backcounter_t *data, char param)
+{
+	switch (param) {
+		case 'l': return data->main.leftvap;
+		case 'p': return data->main.prepaidvap;
+		case 'm': return data->main.limitvap;
+		case 'r': return data->resetvap;
+		case 'A': return data->all_counters;
+		case 'M': return data->all_limits;
+		default:  return data->rollup_table;
+	}
+}
+
+/** Renders query template, substituting placeholders
+ * @retval -1  query too long
+ * @return length of the query */
+static int bcnt_tpl_render(rlm_backcounter_t *data, const struct bcnt_tpl *tpl,
+                           const struct bcnt_args *args, char *out, size_t outlen)
+{
+	const struct bcnt_seg *seg;
+	const char *s;
+	size_t len, pos = 0;
+	int i;
+
+	for (i = 0; i < tpl->count; i++) {
+		seg = &tpl->segs[i];
+
+		if (seg->text) {
+			s   = seg->text;
+			len = seg->len;
+		}
+		else {
+			switch (seg->param) {
+				case 'u': s = args->user;         break;
+				case 'g': s = args->group;        break;
+				case 'a': s = args->attr;         break;
+				case 'v': s = args->value;        break;
+				case 'R': s = args->rows;         break;
+				default:  s = bcnt_tpl_const(data, seg->param); break;
+			}
+
+			if (!s)
+				s = "";
+			len = strlen(s);
+		}
+
+		if (pos + len >= outlen) {
+			bcnt_log(L_ERR, "%s: query too long", tpl->name);
+			return -1;
+		}
+
+		memcpy(out + pos, s, len);
+		pos += len;
+	}
+
+	out[pos] = '\0';
+	return pos;
+}
+
+/** Runs query template; see bcnt_query() */
+static int bcnt_tpl_query(unsigned int line, rlm_backcounter_t *data, struct bcnt_conn *conn,
+                          int q, const char *user, const char *attr, const char *value)
+{
+	char query[MAX_QUERY_LEN];
+	struct bcnt_args args = { user, NULL, attr, value, NULL };
+	int r;
+
+	if (data->backend->tpl_query) {
+		r = (data->backend->tpl_query)(data, conn, q, &args);
+		if (r == 0)
+			bcnt_db_error(line, data, conn);
+		if (r != -2)
+			return r;
+	}
+
+	if (bcnt_tpl_render(data, data->tpl[q], &args, query, sizeof(query)) < 0)
+		return 0;
+
+	return bcnt_exec(line, data, conn, query);
+}
+
+/** Runs select query template with given placeholder values; see bcnt_select() */
+static int bcnt_tpl_fetch(unsigned int line, rlm_backcounter_t *data, struct bcnt_conn *conn,
+                          int q, const struct bcnt_args *args)
+{
+	char query[MAX_QUERY_LEN];
+	int r;
+
+	if (data->backend->tpl_select) {
+		r = (data->backend->tpl_select)(data, conn, q, args);
+		if (r != -2)
+			return bcnt_fetched(line, data, conn, r);
+	}
+
+	if (bcnt_tpl_render(data, data->tpl[q], args, query, sizeof(query)) < 0)
+		return 0;
+
+	return bcnt_fetch(line, data, conn, query);
+}
+
+/** Runs select query template; see bcnt_select() */
+static int bcnt_tpl_select(unsigned int line, rlm_backcounter_t *data, struct bcnt_conn *conn,
+                           int q, const char *user, const char *attr)
+{
+	struct bcnt_args args = { user, NULL, attr, NULL, NULL };
+
+	return bcnt_tpl_fetch(line, data, conn, q, &args);
+}
+
+/*
+ * "sql" backend: rlm_sql instance
+ */
+
+/* MySQL dialect, in order of BCNT_Q_* */
+static const char *bcnt_mysql_queries[BCNT_Q_COUNT] = {
+	/* reset_query */
+	"SELECT `Value` FROM `radreply` "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* limit_query */
+	"SELECT `Value` FROM `radreply` "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* group_limit_query */
+	"SELECT `radgroupreply`.`value` FROM `radgroupreply`, `usergroup` "
+	"WHERE "
+		"`usergroup`.`username`  = '%u' AND "
+		"`usergroup`.`groupname` = `radgroupreply`.`groupname` AND "
+		"`radgroupreply`.`attribute` = '%a' "
+	"ORDER BY `usergroup`.`priority` "
+	"LIMIT 1",
+	/* counters_query */
+	"SELECT `Attribute`, `Value` FROM `radreply` "
+	"WHERE "
+		"`UserName` = '%u' AND "
+		"`Attribute` IN (%A)",
+	/* update_query */
+	"UPDATE `radreply` SET `Value` = '%v' "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* topup_query */
+	"UPDATE `radreply` SET `Value` = CAST(`Value` AS SIGNED) + %v "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* insert_query */
+	"INSERT INTO `radreply` (`UserName`, `Attribute`, `op`, `Value`) "
+	"SELECT '%u', '%a', ':=', '%v' FROM DUAL WHERE NOT EXISTS "
+	"(SELECT 1 FROM `radreply` WHERE `UserName` = '%u' AND `Attribute` = '%a')",
+	/* dump_query */
+	"SELECT `Attribute`, `Value` FROM `radreply` "
+	"WHERE "
+		"`UserName` = '%u' AND "
+		"`Attribute` IN (%A, %M, '%r')",
+	/* rollup_query */
+	"INSERT INTO `%t` (`UserName`, `Period`, `Raw`, `Weighted`) VALUES %R "
+	"ON DUPLICATE KEY UPDATE "
+	"`Raw` = `Raw` + VALUES(`Raw`), `Weighted` = `Weighted` + VALUES(`Weighted`)",
+	/* user_groups_query */
+	"SELECT `GroupName` FROM `usergroup` "
+	"WHERE `UserName` = '%u' ORDER BY `priority`",
+	/* group_value_query */
+	"SELECT `Value` FROM `radgroupreply` "
+	"WHERE `GroupName` = '%g' AND `Attribute` = '%a' LIMIT 1",
+	/* charge_query */
+	"UPDATE `radreply` SET `Value` = GREATEST(CAST(`Value` AS SIGNED) - %v, 0) "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1"
+};
+
+#ifdef HAVE_PTHREAD_H
+/* guards sql_threads lists of all instances against threads exiting */
+static pthread_mutex_t bcnt_sql_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Connects socket owned by a thread (from health check only)
+ * @retval 0   failed, won't be retried for RLM_BC_SQL_RETRY seconds */
+static int bcnt_sql_connect(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if ((data->db->sql_init_socket)(conn->sqlsock, data->sqlinst->config) < 0) {
+		conn->retry = time(NULL) + RLM_BC_SQL_RETRY;
+		bcnt_log(L_ERR, "couldn't connect thread socket #%d", conn->sqlsock->id);
+		return 0;
+	}
+
+	conn->sqlsock->state = sockconnected;
+	BCNT_STAT_INC(data, sql_connects);
+	return 1;
+}
+
+/** Closes and frees socket owned by a thread */
+static void bcnt_sql_close(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if (conn->sqlsock->state == sockconnected || conn->down)
+		(data->db->sql_close)(conn->sqlsock, data->sqlinst->config);
+
+	pthread_mutex_destroy(&conn->mutex);
+	free(conn->sqlsock);
+	free(conn);
+}
+
+/** Destructor of sql_key, run when a worker thread exits */
+static void bcnt_sql_thread_exit(void *ptr)
+{
+	struct bcnt_conn **cell = ptr, *conn, **pp;
+
+	pthread_mutex_lock(&bcnt_sql_threads_mutex);
+
+	/* NULL if the instance is already detached */
+	conn = *cell;
+	if (conn) {
+		for (pp = &conn->data->sql_threads; *pp != conn; pp = &(*pp)->thread_next);
+		*pp = conn->thread_next;
+
+		/* health check has it: let it close the socket when done */
+		if (conn->checking)
+			conn->orphan = 1;
+		else
+			bcnt_sql_close(conn->data, conn);
+	}
+
+	pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+	free(cell);
+}
+
+/** Gets socket of current thread, creating it if needed
+ * Never blocks nor connects: that's left to the health check thread.
+ * @return NULL if the socket is down or being checked */
+static struct bcnt_conn *bcnt_sql_thread_get(rlm_backcounter_t *data)
+{
+	struct bcnt_conn **cell, *conn;
+	time_t now = time(NULL);
+
+	cell = pthread_getspecific(data->sql_key);
+	if (!cell) {
+		cell = rad_malloc(sizeof(*cell));
+		*cell = NULL;
+
+		if (pthread_setspecific(data->sql_key, cell) != 0) {
+			free(cell);
+			return NULL;
+		}
+	}
+
+	conn = *cell;
+	if (!conn) {
+		conn = rad_malloc(sizeof(*conn));
+		memset(conn, 0, sizeof(*conn));
+		conn->sqlsock = rad_malloc(sizeof(SQLSOCK));
+		memset(conn->sqlsock, 0, sizeof(SQLSOCK));
+		conn->sqlsock->state = sockunconnected;
+		conn->owned = 1;
+		conn->data = data;
+		conn->cell = cell;
+		pthread_mutex_init(&conn->mutex, NULL);
+
+		pthread_mutex_lock(&bcnt_sql_threads_mutex);
+		conn->sqlsock->id = ++data->sql_threads_count;
+		conn->thread_next = data->sql_threads;
+		data->sql_threads = conn;
+		pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+
+		*cell = conn;
+		BCNT_STAT_INC(data, sql_thread_socks);
+	}
+
+	/* contended only by a health check in progress */
+	if (pthread_mutex_trylock(&conn->mutex) != 0)
+		return NULL;
+
+	if (conn->sqlsock->state != sockconnected) {
+		pthread_mutex_unlock(&conn->mutex);
+		return NULL;
+	}
+
+	conn->used = now;
+	return conn;
+}
+
+/** Pings thread sockets idle for sql_health_interval and (re)connects the dead ones
+ * Sockets are checked one at a time without holding bcnt_sql_threads_mutex, so
+ * threads starting or exiting meanwhile don't wait for the database. */
+static void bcnt_sql_health(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+	unsigned round = ++data->sql_health_round;
+	time_t now;
+	int ping;
+
+	for (;;) {
+		pthread_mutex_lock(&bcnt_sql_threads_mutex);
+
+		/* next socket not visited in this round */
+		for (conn = data->sql_threads; conn && conn->round == round; conn = conn->thread_next);
+		if (!conn) {
+			pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+			break;
+		}
+		conn->round = round;
+
+		/* in use, so obviously alive */
+		if (pthread_mutex_trylock(&conn->mutex) != 0) {
+			pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+			continue;
+		}
+
+		now = time(NULL);
+		if (conn->sqlsock->state != sockconnected)
+			ping = 0;
+		else if (data->sql_health_interval > 0 && now - conn->used >= data->sql_health_interval)
+			ping = 1;
+		else {
+			pthread_mutex_unlock(&conn->mutex);
+			pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+			continue;
+		}
+
+		if (!ping && now < conn->retry) {
+			pthread_mutex_unlock(&conn->mutex);
+			pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+			continue;
+		}
+
+		/* its thread falls back to the pool while we hold conn->mutex */
+		conn->checking = 1;
+		pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+
+		if (!ping) {
+			/* closed here rather than by the query, so its error could be logged */
+			if (conn->down) {
+				(data->db->sql_close)(conn->sqlsock, data->sqlinst->config);
+				conn->down = 0;
+			}
+
+			bcnt_sql_connect(data, conn);
+		}
+		else {
+			BCNT_STAT_INC(data, sql_health_checks);
+
+			if ((data->db->sql_select_query)(conn->sqlsock, data->sqlinst->config,
+			                                 data->sql_health_query) == 0) {
+				(data->db->sql_finish_select_query)(conn->sqlsock, data->sqlinst->config);
+			}
+			else {
+				BCNT_STAT_INC(data, sql_health_failures);
+				bcnt_log(L_INFO, "thread socket #%d failed health check, reconnecting",
+				         conn->sqlsock->id);
+
+				(data->db->sql_close)(conn->sqlsock, data->sqlinst->config);
+				conn->sqlsock->state = sockunconnected;
+				bcnt_sql_connect(data, conn);
+			}
+		}
+		conn->used = time(NULL);
+
+		pthread_mutex_lock(&bcnt_sql_threads_mutex);
+		conn->checking = 0;
+		pthread_mutex_unlock(&conn->mutex);
+		if (conn->orphan)
+			bcnt_sql_close(data, conn);
+		pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+	}
+}
+
+/** Runs bcnt_sql_health() every RLM_BC_SQL_RETRY seconds until detach */
+static void *bcnt_sql_health_thread(void *arg)
+{
+	rlm_backcounter_t *data = arg;
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = data->sql_pipe[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		r = poll(&pfd, 1, RLM_BC_SQL_RETRY * 1000);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r != 0)
+			break;
+
+		bcnt_sql_health(data);
+	}
+
+	return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+static void bcnt_sql_detach(rlm_backcounter_t *data)
+{
+#ifdef HAVE_PTHREAD_H
+	struct bcnt_conn *conn, *next;
+
+	if (data->sql_health_running) {
+		if (write(data->sql_pipe[1], "", 1) == 1)
+			pthread_join(data->sql_health_thread, NULL);
+
+		close(data->sql_pipe[0]);
+		close(data->sql_pipe[1]);
+		data->sql_health_running = 0;
+	}
+
+	/* cells of threads still running are leaked, as destructors won't run any more */
+	if (data->sql_key_ready) {
+		pthread_key_delete(data->sql_key);
+		data->sql_key_ready = 0;
+
+		pthread_mutex_lock(&bcnt_sql_threads_mutex);
+		for (conn = data->sql_threads; conn; conn = next) {
+			next = conn->thread_next;
+			*conn->cell = NULL;
+			bcnt_sql_close(data, conn);
+		}
+		data->sql_threads = NULL;
+		pthread_mutex_unlock(&bcnt_sql_threads_mutex);
+	}
+#endif
+
+	/* rlm_sql cleans up the pool after itself */
+	if (data->sql_conns) {
+		free(data->sql_conns);
+		data->sql_conns = NULL;
+	}
+}
+
+/** Finds the rlm_sql instance to use, and sets up thread sockets */
+static int bcnt_sql_init(rlm_backcounter_t *data)
+{
+	module_instance_t *modinst;
+
+	modinst = find_module_instance(cf_section_find("modules"), (data->sqlinst_name), 1 );
+	if (!modinst) {
+		bcnt_log(L_ERR, "cannot find module instance named \"%s\"", data->sqlinst_name);
+		return 0;
+	}
+
+	/* check if the given instance is really a rlm_sql instance */
+	if (strcmp(modinst->entry->name, "rlm_sql") != 0) {
+		bcnt_log(L_ERR, "given instance (%s) is not an instance of the rlm_sql module", data->sqlinst_name);
+		return 0;
+	}
+
+	/* save pointers to useful "objects" */
+	data->sqlinst = (SQL_INST *) modinst->insthandle;
+	data->db = (rlm_sql_module_t *) data->sqlinst->module;
+
+	/* pool sockets are numbered from 0, so each can have its bcnt_conn ready */
+	data->sql_conns_count = data->sqlinst->config->num_sql_socks;
+	if (data->sql_conns_count > 0) {
+		data->sql_conns = rad_malloc(sizeof(struct bcnt_conn) * data->sql_conns_count);
+		memset(data->sql_conns, 0, sizeof(struct bcnt_conn) * data->sql_conns_count);
+	}
+
+	if (!data->sql_thread_sockets)
+		return 1;
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_key_create(&data->sql_key, bcnt_sql_thread_exit) != 0) {
+		bcnt_log(L_ERR, "sql_thread_sockets: pthread_key_create() failed");
+		bcnt_sql_detach(data);
+		return 0;
+	}
+	data->sql_key_ready = 1;
+
+	/* the health check thread also connects the sockets, so it's always needed */
+	if (pipe(data->sql_pipe) < 0) {
+		bcnt_log(L_ERR, "sql_thread_sockets: pipe(): %s", strerror(errno));
+		bcnt_sql_detach(data);
+		return 0;
+	}
+
+	if (pthread_create(&data->sql_health_thread, NULL, bcnt_sql_health_thread, data) != 0) {
+		bcnt_log(L_ERR, "sql_thread_sockets: couldn't start health check thread");
+		close(data->sql_pipe[0]);
+		close(data->sql_pipe[1]);
+		bcnt_sql_detach(data);
+		return 0;
+	}
+	data->sql_health_running = 1;
+
+	return 1;
+#else
+	bcnt_log(L_ERR, "sql_thread_sockets needs thread support");
+	bcnt_sql_detach(data);
+	return 0;
+#endif
+}
+
+static struct bcnt_conn *bcnt_sql_get(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+	SQLSOCK *sqlsock;
+
+#ifdef HAVE_PTHREAD_H
+	if (data->sql_thread_sockets) {
+		conn = bcnt_sql_thread_get(data);
+		if (conn)
+			return conn;
+
+		BCNT_STAT_INC(data, sql_fallbacks);
+	}
+#endif
+
+	sqlsock = sql_get_socket(data->sqlinst);
+	if (!sqlsock)
+		return NULL;
+
+	/* the socket is ours until released, and so is its conn */
+	if (sqlsock->id >= 0 && sqlsock->id < data->sql_conns_count)
+		conn = &data->sql_conns[sqlsock->id];
+	else
+		conn = rad_malloc(sizeof(*conn));
+
+	conn->row     = NULL;
+	conn->result  = 0;
+	conn->changes = 0;
+	conn->sqlsock = sqlsock;
+
+	return conn;
+}
+
+static void bcnt_sql_release(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	SQLSOCK *sqlsock = conn->sqlsock;
+
+#ifdef HAVE_PTHREAD_H
+	if (conn->owned) {
+		pthread_mutex_unlock(&conn->mutex);
+		return;
+	}
+#endif
+
+	if (sqlsock->id < 0 || sqlsock->id >= data->sql_conns_count ||
+	    conn != &data->sql_conns[sqlsock->id])
+		free(conn);
+
+	sql_release_socket(data->sqlinst, sqlsock);
+}
+
+/** Sends query on socket
+ * Sockets owned by threads bypass rlm_sql_query(), which would reconnect them
+ * right here; a dead one is marked down, so its thread falls back to the pool
+ * until bcnt_sql_health() reconnects it.
+ * @retval 0   success */
+static int bcnt_sql_send(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query)
+{
+#ifdef HAVE_PTHREAD_H
+	int r;
+
+	if (conn->owned) {
+		r = (data->db->sql_query)(conn->sqlsock, data->sqlinst->config, query);
+		if (r == SQL_DOWN) {
+			bcnt_log(L_INFO, "thread socket #%d is down, leaving it to health check",
+			         conn->sqlsock->id);
+			conn->sqlsock->state = sockunconnected;
+			conn->down = 1;
+		}
+
+		return r;
+	}
+#endif
+
+	return rlm_sql_query(conn->sqlsock, data->sqlinst, query);
+}
+
+static int bcnt_sql_query(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query)
+{
+	return !bcnt_sql_send(data, conn, query);
+}
+
+static int bcnt_sql_select(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query)
+{
+	SQLSOCK *sqlsock = conn->sqlsock;
+
+	if (bcnt_sql_send(data, conn, query))
+		return 0;
+
+	if ((data->db->sql_store_result)(sqlsock, data->sqlinst->config))
+		return 0;
+
+	conn->result = 1;
+
+	if ((data->db->sql_num_rows)(sqlsock, data->sqlinst->config) < 1) {
+		bcnt_finish(data, conn);
+		return -1;
+	}
+
+	if ((data->db->sql_fetch_row)(sqlsock, data->sqlinst->config))
+		return 0;
+
+	conn->row = sqlsock->row;
+	return 1;
+}
+
+static int bcnt_sql_next(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if ((data->db->sql_fetch_row)(conn->sqlsock, data->sqlinst->config)) {
+		bcnt_log(L_ERR, "couldn't fetch next row of query results");
+		return 0;
+	}
+
+	conn->row = conn->sqlsock->row;
+	return (conn->row != NULL);
+}
+
+static void bcnt_sql_finish(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if (conn->result)
+		(data->db->sql_free_result)(conn->sqlsock, data->sqlinst->config);
+
+	(data->db->sql_finish_query)(conn->sqlsock, data->sqlinst->config);
+
+	conn->result = 0;
+	conn->row = NULL;
+}
+
+static int bcnt_sql_num_fields(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	return (data->db->sql_num_fields)(conn->sqlsock, data->sqlinst->config);
+}
+
+static int bcnt_sql_affected_rows(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	return (data->db->sql_affected_rows)(conn->sqlsock, data->sqlinst->config);
+}
+
+static const char *bcnt_sql_error(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	return (const char *)(data->db->sql_error)(conn->sqlsock, data->sqlinst->config);
+}
+
+/** Runs EXPLAIN on query and logs its plan
+ * Only SELECTs are checked, as MySQL before 5.6 can't EXPLAIN anything else.
+ * @param table            name of the first fully scanned table is put here
+ * @retval -1  db error
+ * @retval  0  no full table scans, or query not checked
+ * @retval  1  some table is scanned */
+static int bcnt_sql_explain(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *site,
+                            const char *query, char *table, size_t tablelen)
+{
+	char plan[MAX_QUERY_LEN];
+	size_t len;
+	int i, n, scan = 0;
+
+	query += strspn(query, " \t\r\n(");
+	if (strncasecmp(query, "SELECT", 6) != 0) {
+		bcnt_log(L_DBG, "not checking plan of %s: not a SELECT", site);
+		return 0;
+	}
+
+	switch (bcnt_select(__LINE__, data, conn, "EXPLAIN %s", query)) {
+		case -1: /* no results */
+			return 0;
+		case 0: /* db error */
+			return -1;
+	}
+
+	n = bcnt_sql_num_fields(data, conn);
+
+	do {
+		plan[0] = '\0';
+		for (i = 0, len = 0; i < n; i++) {
+			if (len < sizeof(plan))
+				len += snprintf(plan + len, sizeof(plan) - len, "%s%s",
+				                i ? " | " : "", conn->row[i] ? conn->row[i] : "NULL");
+
+			/* "ALL" can only be in the access type column; if possible_keys
+			 * (the next one) isn't NULL, there is an index, but the table
+			 * is too small for it to be worth using */
+			if (conn->row[i] && strcmp(conn->row[i], "ALL") == 0 &&
+			    (i + 1 >= n || !conn->row[i + 1])) {
+				/* id | select_type | table | ... */
+				if (!scan && n > 2 && conn->row[2])
+					strlcpy(table, conn->row[2], tablelen);
+				scan = 1;
+			}
+		}
+
+		bcnt_log(L_INFO, "plan of %s: %s", site, plan);
+	} while (bcnt_select_next(data, conn));
+
+	bcnt_select_finish(data, conn);
+	return scan;
+}
+
+static const struct bcnt_backend bcnt_backend_sql = {
+	"sql",
+	bcnt_mysql_queries,
+	bcnt_sql_init,
+	bcnt_sql_detach,
+	bcnt_sql_get,
+	bcnt_sql_release,
+	bcnt_sql_query,
+	bcnt_sql_select,
+	bcnt_sql_next,
+	bcnt_sql_finish,
+	bcnt_sql_affected_rows,
+	bcnt_sql_error,
+	bcnt_sql_explain,
+	NULL,
+	NULL
+};
+
+#ifdef HAVE_SQLITE3
+/*
+ * "sqlite" backend: local database file, accessed in-process
+ */
+
+/* SQLite dialect: no UPDATE ... LIMIT, upserts with ON CONFLICT (3.24+) */
+static const char *bcnt_sqlite_queries[BCNT_Q_COUNT] = {
+	/* reset_query */
+	"SELECT `Value` FROM `radreply` "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* limit_query */
+	"SELECT `Value` FROM `radreply` "
+	"WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1",
+	/* group_limit_query */
+	"SELECT `radgroupreply`.`value` FROM `radgroupreply`, `usergroup` "
+	"WHERE "
+		"`usergroup`.`username`  = '%u' AND "
+		"`usergroup`.`groupname` = `radgroupreply`.`groupname` AND "
+		"`radgroupreply`.`attribute` = '%a' "
+	"ORDER BY `usergroup`.`priority` "
+	"LIMIT 1",
+	/* counters_query */
+	"SELECT `Attribute`, `Value` FROM `radreply` "
+	"WHERE "
+		"`UserName` = '%u' AND "
+		"`Attribute` IN (%A)",
+	/* update_query */
+	"UPDATE `radreply` SET `Value` = '%v' WHERE `id` = "
+	"(SELECT `id` FROM `radreply` WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1)",
+	/* topup_query */
+	"UPDATE `radreply` SET `Value` = CAST(`Value` AS INTEGER) + %v WHERE `id` = "
+	"(SELECT `id` FROM `radreply` WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1)",
+	/* insert_query */
+	"INSERT INTO `radreply` (`UserName`, `Attribute`, `op`, `Value`) "
+	"SELECT '%u', '%a', ':=', '%v' WHERE NOT EXISTS "
+	"(SELECT 1 FROM `radreply` WHERE `UserName` = '%u' AND `Attribute` = '%a')",
+	/* dump_query */
+	"SELECT `Attribute`, `Value` FROM `radreply` "
+	"WHERE "
+		"`UserName` = '%u' AND "
+		"`Attribute` IN (%A, %M, '%r')",
+	/* rollup_query */
+	"INSERT INTO `%t` (`UserName`, `Period`, `Raw`, `Weighted`) VALUES %R "
+	"ON CONFLICT (`UserName`, `Period`) DO UPDATE SET "
+	"`Raw` = `Raw` + excluded.`Raw`, `Weighted` = `Weighted` + excluded.`Weighted`",
+	/* user_groups_query */
+	"SELECT `GroupName` FROM `usergroup` "
+	"WHERE `UserName` = '%u' ORDER BY `priority`",
+	/* group_value_query */
+	"SELECT `Value` FROM `radgroupreply` "
+	"WHERE `GroupName` = '%g' AND `Attribute` = '%a' LIMIT 1",
+	/* charge_query */
+	"UPDATE `radreply` SET `Value` = MAX(CAST(`Value` AS INTEGER) - %v, 0) WHERE `id` = "
+	"(SELECT `id` FROM `radreply` WHERE `UserName` = '%u' AND `Attribute` = '%a' LIMIT 1)"
+};
+
+/* created if missing; same layout as the FreeRADIUS SQL schema */
+static const char *bcnt_sqlite_schema[] = {
+	"CREATE TABLE IF NOT EXISTS radreply ("
+		"id INTEGER PRIMARY KEY, "
+		"UserName TEXT NOT NULL DEFAULT '', "
+		"Attribute TEXT NOT NULL DEFAULT '', "
+		"op TEXT NOT NULL DEFAULT '=', "
+		"Value TEXT NOT NULL DEFAULT '')",
+	"CREATE TABLE IF NOT EXISTS radgroupreply ("
+		"id INTEGER PRIMARY KEY, "
+		"GroupName TEXT NOT NULL DEFAULT '', "
+		"Attribute TEXT NOT NULL DEFAULT '', "
+		"op TEXT NOT NULL DEFAULT '=', "
+		"Value TEXT NOT NULL DEFAULT '')",
+	"CREATE TABLE IF NOT EXISTS usergroup ("
+		"UserName TEXT NOT NULL DEFAULT '', "
+		"GroupName TEXT NOT NULL DEFAULT '', "
+		"priority INTEGER NOT NULL DEFAULT 1)",
+	"CREATE INDEX IF NOT EXISTS bcnt_user_attr ON radreply (UserName, Attribute, Value)",
+	"CREATE INDEX IF NOT EXISTS bcnt_user_prio ON usergroup (UserName, priority, GroupName)",
+	"CREATE INDEX IF NOT EXISTS bcnt_group_attr ON radgroupreply (GroupName, Attribute, Value)",
+	NULL
+};
+
+/** Opens new connection to the database file */
+static struct bcnt_conn *bcnt_sqlite_open(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+
+	conn = rad_malloc(sizeof(*conn));
+	memset(conn, 0, sizeof(*conn));
+
+	/* each connection is used by one thread at a time */
+	if (sqlite3_open_v2(data->sqlite_file, &conn->db,
+	                    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+	                    NULL) != SQLITE_OK) {
+		bcnt_log(L_ERR, "couldn't open %s: %s", data->sqlite_file,
+		         conn->db ? sqlite3_errmsg(conn->db) : "out of memory");
+		sqlite3_close(conn->db);
+		free(conn);
+		return NULL;
+	}
+
+	sqlite3_busy_timeout(conn->db, 5000);
+	sqlite3_exec(conn->db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+
+	return conn;
+}
+
+static void bcnt_sqlite_close(struct bcnt_conn *conn)
+{
+	int i;
+
+	if (conn->stmt && !conn->cached)
+		sqlite3_finalize(conn->stmt);
+
+	for (i = 0; i < BCNT_Q_COUNT; i++)
+		if (conn->stmts[i])
+			sqlite3_finalize(conn->stmts[i]);
+
+	sqlite3_close(conn->db);
+	free(conn);
+}
+
+/* SQL parameters of bindable placeholders: quoted '%u', '%g', '%a', '%v', and bare %v */
+#define BCNT_SQLITE_PARAMS "ugav"
+#define BCNT_SQLITE_NUMERIC 5
+
+/** Makes SQL of template with user-dependent placeholders as parameters, so
+ * it's prepared once per connection instead of for every query
+ * @return NULL if the template can't be prepared that way */
+static char *bcnt_sqlite_tpl_sql(rlm_backcounter_t *data, const struct bcnt_tpl *tpl)
+{
+	char buf[MAX_QUERY_LEN], num[8];
+	const struct bcnt_seg *seg, *next;
+	const char *s, *param;
+	size_t len, pos = 0;
+	int i, skip = 0;
+
+	for (i = 0; i < tpl->count; i++) {
+		seg = &tpl->segs[i];
+		next = (i + 1 < tpl->count) ? &tpl->segs[i + 1] : NULL;
+
+		if (seg->text) {
+			/* quote closing a placeholder turned into parameter */
+			s   = seg->text + skip;
+			len = seg->len - skip;
+			skip = 0;
+		}
+		else if ((param = strchr(BCNT_SQLITE_PARAMS, seg->param)) != NULL) {
+			if (pos > 0 && buf[pos - 1] == '\'' &&
+			    next && next->text && next->len > 0 && next->text[0] == '\'') {
+				pos--;
+				skip = 1;
+				snprintf(num, sizeof(num), "?%d", (int) (param - BCNT_SQLITE_PARAMS) + 1);
+			}
+			else if (seg->param == 'v') {
+				snprintf(num, sizeof(num), "?%d", BCNT_SQLITE_NUMERIC);
+			}
+			else {
+				/* part of a longer string */
+				return NULL;
+			}
+
+			s   = num;
+			len = strlen(num);
+		}
+		else if (seg->param == 'R') {
+			return NULL;
+		}
+		else {
+			s = bcnt_tpl_const(data, seg->param);
+			if (!s)
+				s = "";
+			len = strlen(s);
+		}
+
+		if (pos + len >= sizeof(buf))
+			return NULL;
+
+		memcpy(buf + pos, s, len);
+		pos += len;
+	}
+
+	buf[pos] = '\0';
+	return strdup(buf);
+}
+
+static void bcnt_sqlite_release(rlm_backcounter_t *data, struct bcnt_conn *conn);
+static void bcnt_sqlite_detach(rlm_backcounter_t *data);
+
+/** Opens the database file, creating missing tables */
+static int bcnt_sqlite_init(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+	char *err = NULL;
+	int i;
+
+	if (!data->sqlite_file || !*data->sqlite_file) {
+		bcnt_log(L_ERR, "sqlite_file must be set for \"sqlite\" backend");
+		return 0;
+	}
+
+	pthread_mutex_init(&data->sqlite_mutex, NULL);
+	data->sqlite_ready = 1;
+
+	for (i = 0; i < BCNT_Q_COUNT; i++)
+		data->sqlite_sql[i] = bcnt_sqlite_tpl_sql(data, data->tpl[i]);
+
+	conn = bcnt_sqlite_open(data);
+	if (!conn) {
+		bcnt_sqlite_detach(data);
+		return 0;
+	}
+
+	for (i = 0; bcnt_sqlite_schema[i]; i++) {
+		if (sqlite3_exec(conn->db, bcnt_sqlite_schema[i], NULL, NULL, &err) != SQLITE_OK) {
+			bcnt_log(L_ERR, "couldn't create schema in %s: %s", data->sqlite_file, err);
+			sqlite3_free(err);
+			bcnt_sqlite_close(conn);
+			bcnt_sqlite_detach(data);
+			return 0;
+		}
+	}
+
+	if (data->rollup_table && *data->rollup_table) {
+		char *sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" ("
+			"UserName TEXT NOT NULL, "
+			"Period INTEGER NOT NULL, "
+			"Raw INTEGER NOT NULL DEFAULT 0, "
+			"Weighted INTEGER NOT NULL DEFAULT 0, "
+			"PRIMARY KEY (UserName, Period))", data->rollup_table);
+
+		if (sqlite3_exec(conn->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+			bcnt_log(L_ERR, "couldn't create rollup table in %s: %s", data->sqlite_file, err);
+			sqlite3_free(err);
+			sqlite3_free(sql);
+			bcnt_sqlite_close(conn);
+			bcnt_sqlite_detach(data);
+			return 0;
+		}
+		sqlite3_free(sql);
+	}
+
+	/* keep it for later */
+	bcnt_sqlite_release(data, conn);
+	return 1;
+}
+
+static void bcnt_sqlite_detach(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn, *next;
+	int i;
+
+	if (!data->sqlite_ready)
+		return;
+
+	for (conn = data->sqlite_free; conn; conn = next) {
+		next = conn->next;
+		bcnt_sqlite_close(conn);
+	}
+	data->sqlite_free = NULL;
+
+	for (i = 0; i < BCNT_Q_COUNT; i++) {
+		if (data->sqlite_sql[i])
+			free(data->sqlite_sql[i]);
+		data->sqlite_sql[i] = NULL;
+	}
+
+	pthread_mutex_destroy(&data->sqlite_mutex);
+	data->sqlite_ready = 0;
+}
+
+/** Takes idle connection, or opens a new one */
+static struct bcnt_conn *bcnt_sqlite_get(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+
+	pthread_mutex_lock(&data->sqlite_mutex);
+	conn = data->sqlite_free;
+	if (conn)
+		data->sqlite_free = conn->next;
+	pthread_mutex_unlock(&data->sqlite_mutex);
+
+	if (!conn)
+		conn = bcnt_sqlite_open(data);
+
+	return conn;
+}
+
+static void bcnt_sqlite_finish(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if (conn->stmt) {
+		if (conn->cached) {
+			sqlite3_reset(conn->stmt);
+			sqlite3_clear_bindings(conn->stmt);
+		}
+		else {
+			sqlite3_finalize(conn->stmt);
+		}
+
+		conn->stmt = NULL;
+		conn->cached = 0;
+	}
+
+	conn->row = NULL;
+}
+
+static void bcnt_sqlite_release(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	bcnt_sqlite_finish(data, conn);
+
+	pthread_mutex_lock(&data->sqlite_mutex);
+	conn->next = data->sqlite_free;
+	data->sqlite_free = conn;
+	pthread_mutex_unlock(&data->sqlite_mutex);
+}
+
+/** Steps the current statement, making row available
+ * @retval -1  no more rows
+ * @retval  0  db error
+ * @retval  1  success */
+static int bcnt_sqlite_step(struct bcnt_conn *conn)
+{
+	int i, n;
+
+	switch (sqlite3_step(conn->stmt)) {
+		case SQLITE_ROW:
+			n = sqlite3_column_count(conn->stmt);
+			if (n > RLM_BC_MAX_COLS)
+				n = RLM_BC_MAX_COLS;
+
+			for (i = 0; i < n; i++)
+				conn->cols[i] = (char *) sqlite3_column_text(conn->stmt, i);
+
+			conn->row = conn->cols;
+			return 1;
+		case SQLITE_DONE:
+			conn->row = NULL;
+			return -1;
+		default:
+			conn->row = NULL;
+			return 0;
+	}
+}
+
+static int bcnt_sqlite_select(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query)
+{
+	int r;
+
+	bcnt_sqlite_finish(data, conn);
+
+	if (sqlite3_prepare_v2(conn->db, query, -1, &conn->stmt, NULL) != SQLITE_OK)
+		return 0;
+
+	r = bcnt_sqlite_step(conn);
+	if (r == -1)
+		bcnt_sqlite_finish(data, conn);
+
+	return r;
+}
+
+/** Steps the statement started with result r to the end
+ * @return like bcnt_sqlite_query() */
+static int bcnt_sqlite_drain(rlm_backcounter_t *data, struct bcnt_conn *conn, int r)
+{
+	while (r == 1)
+		r = bcnt_sqlite_step(conn);
+
+	if (r == 0)
+		return 0;
+
+	conn->changes = sqlite3_changes(conn->db);
+	bcnt_sqlite_finish(data, conn);
+	return 1;
+}
+
+static int bcnt_sqlite_query(rlm_backcounter_t *data, struct bcnt_conn *conn, char *query)
+{
+	return bcnt_sqlite_drain(data, conn, bcnt_sqlite_select(data, conn, query));
+}
+
+/** Runs template q using connection's prepared statement, see bcnt_backend */
+static int bcnt_sqlite_tpl_select(rlm_backcounter_t *data, struct bcnt_conn *conn, int q,
+                                  const struct bcnt_args *args)
+{
+	const char *vals[BCNT_SQLITE_NUMERIC];
+	sqlite3_stmt *stmt;
+	sqlite3_int64 num;
+	char *end;
+	int i, n, r;
+
+	if (!data->sqlite_sql[q])
+		return -2;
+
+	bcnt_sqlite_finish(data, conn);
+
+	stmt = conn->stmts[q];
+	if (!stmt) {
+		if (sqlite3_prepare_v2(conn->db, data->sqlite_sql[q], -1, &stmt, NULL) != SQLITE_OK)
+			return 0;
+		conn->stmts[q] = stmt;
+	}
+
+	vals[0] = args->user;
+	vals[1] = args->group;
+	vals[2] = args->attr;
+	vals[3] = args->value;
+	vals[4] = args->value;
+
+	n = sqlite3_bind_parameter_count(stmt);
+	for (i = 1; i <= n && i <= BCNT_SQLITE_NUMERIC; i++) {
+		if (!vals[i - 1])
+			continue;
+
+		/* bare %v is used in arithmetic */
+		if (i == BCNT_SQLITE_NUMERIC) {
+			num = strtoll(vals[i - 1], &end, 10);
+			if (*vals[i - 1] && !*end) {
+				sqlite3_bind_int64(stmt, i, num);
+				continue;
+			}
+		}
+
+		sqlite3_bind_text(stmt, i, vals[i - 1], -1, SQLITE_TRANSIENT);
+	}
+
+	conn->stmt = stmt;
+	conn->cached = 1;
+
+	r = bcnt_sqlite_step(conn);
+	if (r == -1)
+		bcnt_sqlite_finish(data, conn);
+
+	return r;
+}
+
+static int bcnt_sqlite_tpl_query(rlm_backcounter_t *data, struct bcnt_conn *conn, int q,
+                                 const struct bcnt_args *args)
+{
+	int r;
+
+	r = bcnt_sqlite_tpl_select(data, conn, q, args);
+	if (r == -2)
+		return r;
+
+	return bcnt_sqlite_drain(data, conn, r);
+}
+
+static int bcnt_sqlite_next(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	if (!conn->stmt)
+		return 0;
+
+	return (bcnt_sqlite_step(conn) == 1);
+}
+
+static int bcnt_sqlite_affected_rows(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	return conn->changes;
+}
+
+static const char *bcnt_sqlite_error(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	return sqlite3_errmsg(conn->db);
+}
+
+/** Runs EXPLAIN QUERY PLAN on query and logs its plan; see bcnt_sql_explain() */
+static int bcnt_sqlite_explain(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *site,
+                               const char *query, char *table, size_t tablelen)
+{
+	const char *detail, *name;
+	size_t len;
+	int scan = 0;
+
+	switch (bcnt_select(__LINE__, data, conn, "EXPLAIN QUERY PLAN %s", query)) {
+		case -1: /* no results */
+			return 0;
+		case 0: /* db error */
+			return -1;
+	}
+
+	do {
+		/* id | parent | notused | detail */
+		detail = conn->row[3];
+		if (!detail)
+			continue;
+
+		bcnt_log(L_INFO, "plan of %s: %s", site, detail);
+
+		/* "SCAN radreply" or "SCAN TABLE radreply" in older versions */
+		if (strncmp(detail, "SCAN ", 5) == 0) {
+			name = detail + 5;
+			if (strncmp(name, "TABLE ", 6) == 0)
+				name += 6;
+
+			if (!scan) {
+				len = strcspn(name, " ");
+				if (len >= tablelen)
+					len = tablelen - 1;
+				memcpy(table, name, len);
+				table[len] = '\0';
+			}
+			scan = 1;
+		}
+	} while (bcnt_select_next(data, conn));
+
+	bcnt_select_finish(data, conn);
+	return scan;
+}
+
+static const struct bcnt_backend bcnt_backend_sqlite = {
+	"sqlite",
+	bcnt_sqlite_queries,
+	bcnt_sqlite_init,
+	bcnt_sqlite_detach,
+	bcnt_sqlite_get,
+	bcnt_sqlite_release,
+	bcnt_sqlite_query,
+	bcnt_sqlite_select,
+	bcnt_sqlite_next,
+	bcnt_sqlite_finish,
+	bcnt_sqlite_affected_rows,
+	bcnt_sqlite_error,
+	bcnt_sqlite_explain,
+	bcnt_sqlite_tpl_query,
+	bcnt_sqlite_tpl_select
+};
+#endif /* HAVE_SQLITE3 */
+
+/* available backends */
+static const struct bcnt_backend *bcnt_backends[] = {
+	&bcnt_backend_sql,
+#ifdef HAVE_SQLITE3
+	&bcnt_backend_sqlite,
+#endif
+	NULL
+};
+
+/** Checks if user name is safe to put in a query */
+static int bcnt_user_ok(const char *user)
+{
+	return (user && *user && !strpbrk(user, "'\"\\`"));
+}
+
+/** Hashes rollup bucket by user name and period */
+static uint32_t bcnt_rollup_hash(const void *ptr)
+{
+	const struct bcnt_rollup *ru = ptr;
+
+	return fr_hash_update(&ru->period, sizeof(ru->period), fr_hash_string(ru->user));
+}
+
+/** Compares rollup buckets */
+static int bcnt_rollup_cmp(const void *one, const void *two)
+{
+	const struct bcnt_rollup *a = one, *b = two;
+
+	if (a->period != b->period)
+		return (a->period < b->period) ? -1 : 1;
+
+	return strcmp(a->user, b->user);
+}
+
+/** Allocates rollup bucket */
+static struct bcnt_rollup *bcnt_rollup_new(const char *user, uint32_t period,
+                                           int64_t raw, int64_t weighted)
+{
+	struct bcnt_rollup *ru;
+	size_t len;
+
+	len = strlen(user);
+	ru = rad_malloc(sizeof(*ru) + len);
+	ru->period   = period;
+	ru->raw      = raw;
+	ru->weighted = weighted;
+	ru->tries    = 0;
+	memcpy(ru->user, user, len + 1);
+
+	return ru;
+}
+
+/** Merges bucket into pending ones; caller must hold rollup_mutex
+ * ru is either inserted or freed; new buckets are dropped if there are
+ * RLM_BC_ROLLUP_MAX pending already, e.g. while the database is down */
+static void bcnt_rollup_put(rlm_backcounter_t *data, struct bcnt_rollup *ru)
+{
+	struct bcnt_rollup *found;
+
+	found = fr_hash_table_finddata(data->rollup, ru);
+	if (found) {
+		found->raw      = bcnt_add(found->raw, ru->raw);
+		found->weighted = bcnt_add(found->weighted, ru->weighted);
+		if (ru->tries > found->tries)
+			found->tries = ru->tries;
+		free(ru);
+	}
+	else if (fr_hash_table_num_elements(data->rollup) >= RLM_BC_ROLLUP_MAX(data)) {
+		BCNT_STAT_INC(data, rollups_dropped);
+		free(ru);
+	}
+	else if (!fr_hash_table_insert(data->rollup, ru)) {
+		bcnt_log(L_ERR, "couldn't add rollup bucket for user '%s'", ru->user);
+		free(ru);
+	}
+}
+
+/** Adds session counters to user's rollup bucket
+ * Users whose names can't be put in the rows of rollup_query are skipped.
+ * If rollups are due, wakes up rollup_thread, or without it asks the caller.
+ * @retval 1   rollups should be flushed now by the caller */
+static int bcnt_rollup_add(rlm_backcounter_t *data, const char *user, uint32_t when,
+                           int64_t raw, int64_t weighted)
+{
+	struct bcnt_rollup *ru;
+	int flush = 0, wake = 0;
+
+	if (!bcnt_user_ok(user)) {
+		bcnt_log(L_DBG, "not adding user '%s' to rollups: unsafe name", user);
+		BCNT_STAT_INC(data, rollups_dropped);
+		return 0;
+	}
+
+	ru = bcnt_rollup_new(user, when - (when % RLM_BC_ROLLUP_PERIOD), raw, weighted);
+
+	pthread_mutex_lock(&data->rollup_mutex);
+
+	bcnt_rollup_put(data, ru);
+
+	/* only one thread flushes at a time */
+	if (!data->rollup_flushing &&
+	    (time(NULL) - data->rollup_flushed >= data->rollup_interval ||
+	     fr_hash_table_num_elements(data->rollup) >= data->rollup_size)) {
+		if (!data->rollup_running) {
+			data->rollup_flushing = 1;
+			flush = 1;
+		}
+		else if (!data->rollup_woken) {
+			data->rollup_woken = 1;
+			wake = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&data->rollup_mutex);
+
+#ifdef HAVE_PTHREAD_H
+	/* keep the upserts off the request path */
+	if (wake && write(data->rollup_pipe[1], "f", 1) != 1) {
+		pthread_mutex_lock(&data->rollup_mutex);
+		data->rollup_woken = 0;
+		pthread_mutex_unlock(&data->rollup_mutex);
+	}
+#endif
+
+	return flush;
+}
+
+struct bcnt_rollup_batch {
+	rlm_backcounter_t *data;
+	struct bcnt_conn *conn;
+	char query[MAX_QUERY_LEN];  /* rendered rollup_query */
+	char values[MAX_QUERY_LEN]; /* rows to put in place of %R */
+	size_t head;                /* length of the query without rows */
+	size_t len;                 /* current length of values */
+	int rows;                   /* number of rows in values */
+	int failed;                 /* number of buckets put back due to db errors */
+	int dropped;                /* ...and of those dropped after RLM_BC_ROLLUP_TRIES */
+	struct bcnt_rollup *items[RLM_BC_ROLLUP_BATCH]; /* buckets in values */
+};
+
+/** Sends the batched rollup upsert to the database
+ * On error, buckets are merged back into pending ones for the next flush,
+ * unless they failed RLM_BC_ROLLUP_TRIES times already. */
+static void bcnt_rollup_send(struct bcnt_rollup_batch *batch)
+{
+	rlm_backcounter_t *data = batch->data;
+	struct bcnt_args args = { NULL, NULL, NULL, NULL, batch->values };
+	struct bcnt_rollup *ru, *again;
+	int i;
+
+	if (!batch->rows)
+		return;
+
+	if (bcnt_tpl_render(data, data->tpl[BCNT_Q_ROLLUP], &args,
+	                    batch->query, sizeof(batch->query)) >= 0 &&
+	    bcnt_exec(__LINE__, data, batch->conn, batch->query))
+		bcnt_finish(data, batch->conn);
+	else {
+		pthread_mutex_lock(&data->rollup_mutex);
+		for (i = 0; i < batch->rows; i++) {
+			ru = batch->items[i];
+			if (ru->tries + 1 >= RLM_BC_ROLLUP_TRIES) {
+				batch->dropped++;
+				continue;
+			}
+
+			again = bcnt_rollup_new(ru->user, ru->period, ru->raw, ru->weighted);
+			again->tries = ru->tries + 1;
+			bcnt_rollup_put(data, again);
+		}
+		pthread_mutex_unlock(&data->rollup_mutex);
+
+		batch->failed += batch->rows;
+	}
+
+	batch->len  = 0;
+	batch->rows = 0;
+}
+
+/** Adds one rollup bucket to the batch, sending the batch first if it's full */
+static int bcnt_rollup_batch_add(void *ctx, void *ptr)
+{
+	struct bcnt_rollup_batch *batch = ctx;
+	struct bcnt_rollup *ru = ptr;
+	char row[MAX_STRING_LEN + 128];
+	int len;
+
+	len = snprintf(row, sizeof(row), "('%s', %u, %" PRId64 ", %" PRId64 ")",
+	               ru->user, ru->period, ru->raw, ru->weighted);
+
+	if (batch->head + batch->len + len + 2 >= sizeof(batch->query) ||
+	    batch->rows == RLM_BC_ROLLUP_BATCH)
+		bcnt_rollup_send(batch);
+
+	if (batch->rows) {
+		memcpy(batch->values + batch->len, ", ", 2);
+		batch->len += 2;
+	}
+
+	memcpy(batch->values + batch->len, row, len + 1);
+	batch->len += len;
+	batch->items[batch->rows++] = ru;
+
+	return 0;
+}
+
+/** Writes pending rollup buckets to the database in batched upserts */
+static void bcnt_rollup_flush(rlm_backcounter_t *data, struct bcnt_conn *conn)
+{
+	fr_hash_table_t *pending, *fresh;
+	struct bcnt_rollup_batch *batch;
+	struct bcnt_args args = { NULL, NULL, NULL, NULL, "" };
+	int count, len;
+
+	/* swap in an empty table, so other threads don't wait for the db */
+	fresh = fr_hash_table_create(bcnt_rollup_hash, bcnt_rollup_cmp, free);
+
+	pthread_mutex_lock(&data->rollup_mutex);
+	if (!fresh) {
+		data->rollup_flushing = 0;
+		pthread_mutex_unlock(&data->rollup_mutex);
+		return;
+	}
+	pending = data->rollup;
+	data->rollup = fresh;
+	data->rollup_flushed = time(NULL);
+	pthread_mutex_unlock(&data->rollup_mutex);
+
+	count = fr_hash_table_num_elements(pending);
+	if (count > 0) {
+		batch = rad_malloc(sizeof(*batch));
+
+		/* if even that is too long, bcnt_rollup_send() puts all rows back */
+		len = bcnt_tpl_render(data, data->tpl[BCNT_Q_ROLLUP], &args,
+		                      batch->query, sizeof(batch->query));
+		batch->head    = (len < 0) ? 0 : len;
+		batch->data    = data;
+		batch->conn = conn;
+		batch->len     = 0;
+		batch->rows    = 0;
+		batch->failed  = 0;
+		batch->dropped = 0;
+
+		fr_hash_table_walk(pending, bcnt_rollup_batch_add, batch);
+		bcnt_rollup_send(batch);
+
+		if (batch->dropped) {
+			BCNT_STAT_ADD(data, rollups_dropped, batch->dropped);
+			bcnt_log(L_ERR, "dropped %d rollup buckets which failed %d flushes",
+			         batch->dropped, RLM_BC_ROLLUP_TRIES);
+		}
+
+		if (batch->failed > batch->dropped)
+			bcnt_log(L_ERR, "couldn't flush %d of %d rollup buckets due to database errors, "
+			         "will retry", batch->failed - batch->dropped, count);
+		else
+			bcnt_log(L_DBG, "flushed %d rollup buckets", count);
+
+		free(batch);
+	}
+
+	fr_hash_table_free(pending);
+
+	pthread_mutex_lock(&data->rollup_mutex);
+	data->rollup_flushing = 0;
+	pthread_mutex_unlock(&data->rollup_mutex);
+}
+
+/** Flushes pending rollups if rollup_interval passed since the last flush
+ * @param force   flush anyway, if there's anything to flush */
+static void bcnt_rollup_tick(rlm_backcounter_t *data, int force)
+{
+	struct bcnt_conn *conn;
+	int flush;
+
+	pthread_mutex_lock(&data->rollup_mutex);
+	flush = !data->rollup_flushing && fr_hash_table_num_elements(data->rollup) > 0 &&
+	        (force || time(NULL) - data->rollup_flushed >= data->rollup_interval);
+	if (flush)
+		data->rollup_flushing = 1;
+	pthread_mutex_unlock(&data->rollup_mutex);
+
+	if (!flush)
+		return;
+
+	conn = bcnt_conn_get(data);
+	if (!conn) {
+		bcnt_log(L_ERR, "couldn't connect to database to flush rollups");
+
+		pthread_mutex_lock(&data->rollup_mutex);
+		data->rollup_flushing = 0;
+		pthread_mutex_unlock(&data->rollup_mutex);
+		return;
+	}
+
+	bcnt_rollup_flush(data, conn);
+	bcnt_conn_release(data, conn);
+}
+
+#ifdef HAVE_PTHREAD_H
+/** Flushes rollups every rollup_interval even if no Stop packets come,
+ * or earlier when woken up by bcnt_rollup_add() */
+static void *bcnt_rollup_thread(void *arg)
+{
+	rlm_backcounter_t *data = arg;
+	struct pollfd pfd;
+	time_t wait;
+	char c;
+	int r;
+
+	pfd.fd = data->rollup_pipe[0];
+	pfd.events = POLLIN;
+
+	for (;;) {
+		/* wake up when the interval since the last flush (maybe by accounting) ends */
+		pthread_mutex_lock(&data->rollup_mutex);
+		wait = data->rollup_flushed + data->rollup_interval - time(NULL);
+		pthread_mutex_unlock(&data->rollup_mutex);
+
+		if (wait < 1)
+			wait = 1;
+		else if (wait > data->rollup_interval)
+			wait = data->rollup_interval;
+
+		r = poll(&pfd, 1, wait * 1000);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+
+		if (r == 0) {
+			bcnt_rollup_tick(data, 0);
+			continue;
+		}
+
+		/* "f" asks for a flush, anything else (or error) for exit */
+		if (read(data->rollup_pipe[0], &c, 1) != 1 || c != 'f')
+			break;
+
+		pthread_mutex_lock(&data->rollup_mutex);
+		data->rollup_woken = 0;
+		pthread_mutex_unlock(&data->rollup_mutex);
+
+		bcnt_rollup_tick(data, 1);
+	}
+
+	return NULL;
+}
+
+/** Starts rollup_thread */
+static int bcnt_rollup_start(rlm_backcounter_t *data)
+{
+	if (pipe(data->rollup_pipe) < 0) {
+		bcnt_log(L_ERR, "rollups: pipe(): %s", strerror(errno));
+		return 0;
+	}
+
+	if (pthread_create(&data->rollup_thread, NULL, bcnt_rollup_thread, data) != 0) {
+		bcnt_log(L_ERR, "rollups: couldn't start flush thread");
+		close(data->rollup_pipe[0]);
+		close(data->rollup_pipe[1]);
+		return 0;
+	}
+	data->rollup_running = 1;
+
+	return 1;
+}
+
+/** Stops rollup_thread */
+static void bcnt_rollup_stop(rlm_backcounter_t *data)
+{
+	if (!data->rollup_running)
+		return;
+
+	if (write(data->rollup_pipe[1], "", 1) == 1)
+		pthread_join(data->rollup_thread, NULL);
+
+	close(data->rollup_pipe[0]);
+	close(data->rollup_pipe[1]);
+	data->rollup_running = 0;
+}
+#endif /* HAVE_PTHREAD_H */
+
+/** Returns counter values fetched in authorize for this request
+ * e.g. %{transfer-limit:left}, %{transfer-limit:prepaid}, %{transfer-limit:reset} */
+static size_t backcounter_xlat(void *instance, REQUEST *request, char *fmt, char *out,
+                               size_t freespace, RADIUS_ESCAPE_STRING func)
+{
+	struct bcnt_state *state;
+	struct bcnt_dim_state *ds;
+	char what[16];
+	int i, len;
+	rlm_backcounter_t *data = (rlm_backcounter_t *) instance;
+
+	/* no SQL here: only what authorize has already seen */
+	state = request_data_reference(request, data, 0);
+	if (!state) {
+		bcnt_log(L_DBG, "no counters fetched for this request");
+		*out = '\0';
+		return 0;
+	}
+
+	while (isspace((int) *fmt))
+		fmt++;
+
+	*out = '\0';
+
+	/* "<what> [dimension]" */
+	len = strcspn(fmt, " \t");
+	if (len >= (int) sizeof(what)) {
+		bcnt_log(L_ERR, "unknown xlat argument: %s", fmt);
+		return 0;
+	}
+	memcpy(what, fmt, len);
+	what[len] = '\0';
+
+	for (fmt += len; isspace((int) *fmt); fmt++);
+
+	for (i = 0; *fmt && i < data->dims_count; i++)
+		if (strcmp(data->dims[i]->name, fmt) == 0)
+			break;
+
+	if (i == data->dims_count) {
+		bcnt_log(L_ERR, "unknown dimension in xlat: %s", fmt);
+		return 0;
+	}
+
+	/* i is 0 if no dimension was given */
+	ds = &state->dims[i];
+
+	if (strcmp(what, "left") == 0) {
+		if (ds->has_left)
+			snprintf(out, freespace, "%" PRId64, ds->left);
+	}
+	else if (strcmp(what, "prepaid") == 0) {
+		if (ds->has_prepaid)
+			snprintf(out, freespace, "%" PRId64, ds->prepaid);
+	}
+	else if (strcmp(what, "counter") == 0) {
+		if (BCNT_LIMITED(ds))
+			snprintf(out, freespace, "%" PRId64, ds->counter);
+	}
+	else if (strcmp(what, "reset") == 0) {
+		if (state->reset)
+			snprintf(out, freespace, "%u", state->reset);
+	}
+	else {
+		bcnt_log(L_ERR, "unknown xlat argument: %s", what);
+	}
+
+	return strlen(out);
+}
+
+/*
+ * TTL caches of query results
+ */
+
+/** Hashes cache entry by its key */
+static uint32_t bcnt_cache_hash(const void *ptr)
+{
+	return fr_hash_string(((const struct bcnt_cache_entry *) ptr)->key);
+}
+
+/** Compares cache entries */
+static int bcnt_cache_cmp(const void *one, const void *two)
+{
+	return strcmp(((const struct bcnt_cache_entry *) one)->key,
+	              ((const struct bcnt_cache_entry *) two)->key);
+}
+
+/** Prepares cache; it stays disabled if ttl <= 0
+ * @retval 0   error */
+static int bcnt_cache_init(rlm_backcounter_t *data, struct bcnt_cache *cache, const char *name, int ttl)
+{
+	cache->name = name;
+	cache->ttl  = ttl;
+	cache->size = data->cache_size;
+
+	if (ttl <= 0)
+		return 1;
+
+	cache->ht = fr_hash_table_create(bcnt_cache_hash, bcnt_cache_cmp, free);
+	if (!cache->ht) {
+		bcnt_log(L_ERR, "couldn't create %s cache", name);
+		return 0;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	return 1;
+}
+
+static void bcnt_cache_free(struct bcnt_cache *cache)
+{
+	if (!cache->ht)
+		return;
+
+	fr_hash_table_free(cache->ht);
+	pthread_mutex_destroy(&cache->mutex);
+	cache->ht = NULL;
+}
+
+/** Looks key up in cache, copying its value to buf
+ * @retval -1  not cached, stale, or doesn't fit in buf
+ * @retval  0  cached as not found
+ * @retval  1  cached, value copied to buf */
+static int bcnt_cache_get(struct bcnt_cache *cache, const char *key,
+                          char *buf, size_t buflen, time_t now)
+{
+	struct bcnt_cache_entry find, *found;
+	int r = -1;
+
+	if (!cache->ht)
+		return -1;
+
+	find.key = key;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	found = fr_hash_table_finddata(cache->ht, &find);
+	if (found && found->expires > now) {
+		if (!found->value) {
+			r = 0;
+		}
+		else if (found->len <= buflen) {
+			memcpy(buf, found->value, found->len);
+			r = 1;
+		}
+	}
+
+	if (r < 0)
+		cache->misses++;
+	else
+		cache->hits++;
+
+	pthread_mutex_unlock(&cache->mutex);
+	return r;
+}
+
+/** Stores len bytes of value for key until given time, replacing older entry
+ * @param value            NULL caches key as not found */
+static void bcnt_cache_put_until(rlm_backcounter_t *data, struct bcnt_cache *cache, const char *key,
+                                 const char *value, size_t len, time_t expires)
+{
+	struct bcnt_cache_entry *entry;
+	fr_hash_table_t *full = NULL;
+	size_t klen;
+
+	if (!cache->ht)
+		return;
+
+	klen = strlen(key) + 1;
+	if (!value)
+		len = 0;
+
+	entry = rad_malloc(sizeof(*entry) + klen + len);
+	memcpy(entry->buf, key, klen);
+	entry->key     = entry->buf;
+	entry->value   = value ? entry->buf + klen : NULL;
+	entry->len     = len;
+	entry->expires = expires;
+	if (value)
+		memcpy(entry->buf + klen, value, len);
+
+	pthread_mutex_lock(&cache->mutex);
+
+	/* crude, but cheap: start over when full */
+	if (fr_hash_table_num_elements(cache->ht) >= cache->size) {
+		full = cache->ht;
+		cache->ht = fr_hash_table_create(bcnt_cache_hash, bcnt_cache_cmp, free);
+		if (!cache->ht) {
+			cache->ht = full;
+			full = NULL;
+		}
+		else {
+			cache->flushes++;
+			cache->evictions += fr_hash_table_num_elements(full);
+		}
+	}
+
+	if (!fr_hash_table_replace(cache->ht, entry))
+		free(entry);
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (full) {
+		bcnt_log(L_DBG, "%s cache full - emptied it", cache->name);
+		fr_hash_table_free(full);
+	}
+}
+
+/** Stores len bytes of value for key for the cache's ttl; see bcnt_cache_put_until() */
+static void bcnt_cache_put(rlm_backcounter_t *data, struct bcnt_cache *cache, const char *key,
+                           const char *value, size_t len, time_t now)
+{
+	bcnt_cache_put_until(data, cache, key, value, len, now + cache->ttl);
+}
+
+/** Drops key from cache
+ * @param key              NULL drops all entries
+ * @return number of entries dropped */
+static int bcnt_cache_drop(struct bcnt_cache *cache, const char *key)
+{
+	struct bcnt_cache_entry find;
+	fr_hash_table_t *old, *fresh;
+	int r;
+
+	if (!cache->ht)
+		return 0;
+
+	if (key) {
+		find.key = key;
+
+		pthread_mutex_lock(&cache->mutex);
+		r = fr_hash_table_delete(cache->ht, &find) ? 1 : 0;
+		pthread_mutex_unlock(&cache->mutex);
+
+		return r;
+	}
+
+	fresh = fr_hash_table_create(bcnt_cache_hash, bcnt_cache_cmp, free);
+	if (!fresh)
+		return 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	old = cache->ht;
+	cache->ht = fresh;
+	pthread_mutex_unlock(&cache->mutex);
+
+	r = fr_hash_table_num_elements(old);
+	fr_hash_table_free(old);
+	return r;
+}
+
+/** Builds key of group_limits entry; limits of each dimension are cached separately */
+static void bcnt_group_key(char *key, size_t len, const char *group, const struct bcnt_dim *dim)
+{
+	snprintf(key, len, "%s\t%s", group, dim->limitvap);
+}
+
+/** Finds limitvap of dimension in the first of user's groups (by priority) which has it,
+ * using caches
+ * @retval -1  not found
+ * @retval  0  db error
+ * @retval  1  found, stored in *limit */
+static int bcnt_group_limit(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *user,
+                            const struct bcnt_dim *dim, int64_t *limit)
+{
+	char groups[MAX_QUERY_LEN]; /* "\0"-terminated names, followed by an empty one */
+	char value[MAX_STRING_LEN];
+	char key[MAX_STRING_LEN];
+	struct bcnt_args args = { user, NULL, dim->limitvap, NULL, NULL };
+	const char *group;
+	size_t len = 0, glen;
+	time_t now = time(NULL);
+	int r;
+
+	/* user's groups */
+	if (bcnt_cache_get(&data->user_groups, user, groups, sizeof(groups), now) < 1) {
+		switch (bcnt_tpl_fetch(__LINE__, data, conn, BCNT_Q_USER_GROUPS, &args)) {
+			case -1: /* no results */
+				break;
+			case 0: /* db error */
+				return 0;
+			default:
+				do {
+					if (!conn->row[0] || !*conn->row[0])
+						continue;
+
+					glen = strlen(conn->row[0]) + 1;
+					if (len + glen >= sizeof(groups)) {
+						bcnt_log(L_ERR, "user '%s' has too many groups - ignoring the rest", user);
+						break;
+					}
+
+					memcpy(groups + len, conn->row[0], glen);
+					len += glen;
+				} while (bcnt_select_next(data, conn));
+
+				bcnt_select_finish(data, conn);
+				break;
+		}
+
+		groups[len++] = '\0';
+		bcnt_cache_put(data, &data->user_groups, user, groups, len, now);
+	}
+
+	/* first group with limit wins */
+	for (group = groups; *group; group += strlen(group) + 1) {
+		bcnt_group_key(key, sizeof(key), group, dim);
+		r = bcnt_cache_get(&data->group_limits, key, value, sizeof(value), now);
+
+		if (r < 0) {
+			args.group = group;
+
+			switch (bcnt_tpl_fetch(__LINE__, data, conn, BCNT_Q_GROUP_VALUE, &args)) {
+				case -1: /* no results */
+					bcnt_cache_put(data, &data->group_limits, key, NULL, 0, now);
+					r = 0;
+					break;
+				case 0: /* db error */
+					return 0;
+				default:
+					strlcpy(value, conn->row[0] ? conn->row[0] : "", sizeof(value));
+					bcnt_select_finish(data, conn);
+
+					bcnt_cache_put(data, &data->group_limits, key, value, strlen(value) + 1, now);
+					r = 1;
+					break;
+			}
+		}
+
+		if (r == 1) {
+			*limit = bcnt_parse(value);
+			bcnt_log(L_DBG, "using %s of group '%s'", dim->limitvap, group);
+			return 1;
+		}
+	}
+
+	return -1;
+}
+
+/** Fetches limitvap of dimension from user, or from user's groups
+ * @retval 0   db error
+ * @retval 1   success; *limit is 0 if not set */
+static int bcnt_limit(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *user,
+                      const struct bcnt_dim *dim, int64_t *limit)
+{
+	*limit = 0;
+
+	/* fetch limitvap from user */
+	switch (bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_LIMIT,
+	        user, dim->limitvap)) {
+		case -1: /* no results */
+			/* fetch limitvap from group */
+			if (data->group_cache_ttl > 0)
+				return (bcnt_group_limit(data, conn, user, dim, limit) != 0);
+
+			switch (bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_GROUP_LIMIT,
+			        user, dim->limitvap)) {
+				case -1: /* no results */
+					break;
+				case 0: /* db error */
+					return 0;
+				default:
+					*limit = bcnt_parse(conn->row[0]);
+					bcnt_log(L_DBG, "using %s defined in radgroupreply: %" PRId64,
+					         dim->limitvap, *limit);
+					bcnt_select_finish(data, conn);
+					break;
+			}
+			break;
+		case 0: /* db error */
+			return 0;
+		default:
+			*limit = bcnt_parse(conn->row[0]);
+			bcnt_log(L_DBG, "using %s defined in radreply: %" PRId64, dim->limitvap, *limit);
+			bcnt_select_finish(data, conn);
+			break;
+	}
+
+	return 1;
+}
+
+/** Resets user's counters to the values of limitvaps (may be in group reply)
+ * @param rsttime          current reset time, updated to the next one on reset
+ * @retval 0   db error
+ * @retval 1   success, also if no limitvap is set */
+static int bcnt_reset(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *user,
+                      uint32_t curtime, uint32_t *rsttime)
+{
+	struct bcnt_dim *dim;
+	int64_t resetval;
+	char value[32];
+	char fields[RLM_BC_EVENT_LINE]; /* new counters, for the event log */
+	size_t len = 0;
+	int i, n = 0;
+
+	bcnt_log(L_DBG, "resetting user '%s' counters", user);
+
+	for (i = 0; i < data->dims_count; i++) {
+		dim = data->dims[i];
+
+		if (!bcnt_limit(data, conn, user, dim, &resetval))
+			return 0;
+
+		/* if <= 0, we won't update db */
+		if (resetval <= 0)
+			continue;
+
+		/* update leftvap in db */
+		snprintf(value, sizeof(value), "%" PRId64, resetval);
+		if (!bcnt_tpl_query(__LINE__, data, conn, BCNT_Q_UPDATE,
+		    user, dim->leftvap, value))
+			return 0;
+		bcnt_finish(data, conn);
+		n++;
+
+		/* "left=" of main dimension, "<name>_left=" of others */
+		len += snprintf(fields + len, sizeof(fields) - len, "%s%sleft=%" PRId64 " ",
+		                i ? dim->name : "", i ? "_" : "", resetval);
+		if (len >= sizeof(fields))
+			len = sizeof(fields) - 1;
+	}
+	fields[len] = '\0';
+
+	if (n == 0) {
+		bcnt_log(L_INFO, "couldn't fetch resetval although it's reset time: user '%s'", user);
+		return 1;
+	}
+
+	/* update next reset time (make sure it's greater than current time) */
+	while (*rsttime < curtime)
+		*rsttime += data->period;
+
+	bcnt_log(L_DBG, "new reset time for user '%s': %u", user, *rsttime);
+
+	/* update resetvap in db */
+	snprintf(value, sizeof(value), "%u", *rsttime);
+	if (!bcnt_tpl_query(__LINE__, data, conn, BCNT_Q_UPDATE,
+	    user, data->resetvap, value))
+		return 0;
+	bcnt_finish(data, conn);
+
+	BCNT_STAT_INC(data, resets);
+	bcnt_event(data, "reset", user, 0, "%snext_reset=%u", fields, *rsttime);
+	return 1;
+}
+
+/** Drops everything the module remembers about user
+ * @param user             user name, or NULL for all users
+ * @return number of entries dropped */
+static int bcnt_invalidate(rlm_backcounter_t *data, const char *user)
+{
+	int r;
+
+	bcnt_log(L_DBG, "invalidating %s%s%s", user ? "user '" : "all users",
+	         user ? user : "", user ? "'" : "");
+
+	r = bcnt_cache_drop(&data->user_groups, user);
+	r += bcnt_cache_drop(&data->overlimit, user);
+
+	/* group limits aren't per user, but "all" should mean all */
+	if (!user)
+		r += bcnt_cache_drop(&data->group_limits, NULL);
+
+	return r;
+}
+
+/** Drops cached limits of group in all dimensions
+ * @param group            group name, or NULL for all groups
+ * @return number of entries dropped */
+static int bcnt_invalidate_group(rlm_backcounter_t *data, const char *group)
+{
+	char key[MAX_STRING_LEN];
+	int i, r = 0;
+
+	if (!group)
+		return bcnt_cache_drop(&data->group_limits, NULL);
+
+	for (i = 0; i < data->dims_count; i++) {
+		bcnt_group_key(key, sizeof(key), group, data->dims[i]);
+		r += bcnt_cache_drop(&data->group_limits, key);
+	}
+
+	return r;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Control socket
+ */
+
+struct bcnt_ctl_client {
+	int        fd;              /* -1 if slot is free */
+	char       buf[RLM_BC_CTL_LINE]; /* received part of command line */
+	size_t     len;             /* length of buf */
+	int        interval;        /* if > 0, stream stats each that many seconds */
+	time_t     next;            /* when to send stats next time */
+};
+
+/** Sends formatted text to control socket client
+ * @retval 0   error
+ * @retval 1   success */
+static int bcnt_ctl_printf(struct bcnt_ctl_client *cl, const char *fmt, ...)
+{
+	va_list ap;
+	char buf[RLM_BC_CTL_REPLY];
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len >= (int) sizeof(buf))
+		len = sizeof(buf) - 1;
+
+	return (send(cl->fd, buf, len, MSG_NOSIGNAL) == len);
+}
+
+/** Sends current statistics */
+static int bcnt_ctl_stats(rlm_backcounter_t *data, struct bcnt_ctl_client *cl)
+{
+	return bcnt_ctl_printf(cl,
+		"stats time=%lu authorize=%lu accounting=%lu resets=%lu overlimit=%lu "
+		"rejects=%lu topups=%lu db_errors=%lu events=%lu events_suppressed=%lu "
+		"group_cache_hits=%lu group_cache_misses=%lu group_cache_flushes=%lu "
+		"user_group_cache_hits=%lu user_group_cache_misses=%lu user_group_cache_flushes=%lu "
+		"conn_gets=%lu conn_waits=%lu conn_wait_us=%lu conn_wait_max_us=%lu "
+		"sql_thread_socks=%lu sql_connects=%lu sql_fallbacks=%lu "
+		"sql_health_checks=%lu sql_health_failures=%lu "
+		"overlimit_cache_hits=%lu overlimit_cache_misses=%lu overlimit_cache_evictions=%lu "
+		"rollups_dropped=%lu\n",
+		(unsigned long) time(NULL),
+		data->stats.authorize, data->stats.accounting, data->stats.resets,
+		data->stats.overlimit, data->stats.rejects, data->stats.topups,
+		data->stats.db_errors, data->stats.events, data->stats.events_suppressed,
+		data->group_limits.hits, data->group_limits.misses, data->group_limits.flushes,
+		data->user_groups.hits, data->user_groups.misses, data->user_groups.flushes,
+		data->stats.conn_gets, data->stats.conn_waits, data->stats.conn_wait_us,
+		data->stats.conn_wait_max_us, data->stats.sql_thread_socks,
+		data->stats.sql_connects, data->stats.sql_fallbacks,
+		data->stats.sql_health_checks, data->stats.sql_health_failures,
+		data->overlimit.hits, data->overlimit.misses, data->overlimit.evictions,
+		data->stats.rollups_dropped);
+}
+
+/** Adds amount to user's prepaid counter of dimension, creating it if necessary
+ * @param dim_name         dimension name, NULL for main */
+static int bcnt_ctl_topup(rlm_backcounter_t *data, struct bcnt_ctl_client *cl, struct bcnt_conn *conn,
+                          const char *user, const char *amount_str, const char *dim_name)
+{
+	struct bcnt_dim *dim = &data->main;
+	int64_t amount;
+	char *end;
+	char value[32];
+	int i, r;
+
+	if (!amount_str)
+		return bcnt_ctl_printf(cl, "ERR missing amount\n");
+
+	errno = 0;
+	amount = strtoll(amount_str, &end, 10);
+	if (amount <= 0 || *end || errno)
+		return bcnt_ctl_printf(cl, "ERR invalid amount\n");
+
+	if (dim_name) {
+		for (i = 0; i < data->dims_count; i++)
+			if (strcmp(data->dims[i]->name, dim_name) == 0)
+				break;
+
+		if (i == data->dims_count)
+			return bcnt_ctl_printf(cl, "ERR unknown dimension\n");
+
+		dim = data->dims[i];
+	}
+
+	if (!*dim->prepaidvap)
+		return bcnt_ctl_printf(cl, "ERR dimension has no prepaid counter\n");
+
+	snprintf(value, sizeof(value), "%" PRId64, amount);
+
+	/* add to existing counter; if there's none, create it unless someone else just did,
+	 * in which case add to theirs */
+	for (i = 0; i < 3; i++) {
+		if (!bcnt_tpl_query(__LINE__, data, conn, i == 1 ? BCNT_Q_INSERT : BCNT_Q_TOPUP,
+		    user, dim->prepaidvap, value))
+			return bcnt_ctl_printf(cl, "ERR database error\n");
+
+		r = (data->backend->affected_rows)(data, conn);
+		bcnt_finish(data, conn);
+
+		if (r > 0)
+			break;
+	}
+
+	if (i == 3)
+		return bcnt_ctl_printf(cl, "ERR couldn't update prepaid counter\n");
+
+	bcnt_invalidate(data, user);
+	BCNT_STAT_INC(data, topups);
+	bcnt_event(data, "topup", user, 0, "amount=%" PRId64 " dimension=%s", amount, dim->name);
+
+	bcnt_log(L_INFO, "user '%s' prepaid counter of %s topped up by %" PRId64,
+	         user, dim->name, amount);
+	return bcnt_ctl_printf(cl, "OK\n");
+}
+
+/** Shows user's counters as stored in db */
+static int bcnt_ctl_dump(rlm_backcounter_t *data, struct bcnt_ctl_client *cl, struct bcnt_conn *conn,
+                         const char *user)
+{
+	switch (bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_DUMP, user, NULL)) {
+		case -1: /* no results */
+			return bcnt_ctl_printf(cl, "ERR user has no counters\n");
+		case 0: /* db error */
+			return bcnt_ctl_printf(cl, "ERR database error\n");
+		default:
+			do {
+				if (!conn->row[0] || !conn->row[1])
+					continue;
+
+				if (!bcnt_ctl_printf(cl, "%s = %s\n", conn->row[0], conn->row[1])) {
+					bcnt_select_finish(data, conn);
+					return 0;
+				}
+			} while (bcnt_select_next(data, conn));
+
+			bcnt_select_finish(data, conn);
+			return bcnt_ctl_printf(cl, "OK\n");
+	}
+}
+
+/** Resets user's counter now, keeping the reset schedule */
+static int bcnt_ctl_reset(rlm_backcounter_t *data, struct bcnt_ctl_client *cl, struct bcnt_conn *conn,
+                          const char *user)
+{
+	uint32_t curtime, rsttime;
+
+	curtime = (uint32_t) time(NULL);
+
+	switch (bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_RESET,
+	        user, data->resetvap)) {
+		case -1: /* no results */
+			return bcnt_ctl_printf(cl, "ERR user has no '%s' attribute\n", data->resetvap);
+		case 0: /* db error */
+			return bcnt_ctl_printf(cl, "ERR database error\n");
+		default:
+			rsttime = strtoul(conn->row[0], (char **) NULL, 10);
+			bcnt_select_finish(data, conn);
+			break;
+	}
+
+	if (!bcnt_reset(data, conn, user, curtime, &rsttime))
+		return bcnt_ctl_printf(cl, "ERR database error\n");
+
+	bcnt_invalidate(data, user);
+	return bcnt_ctl_printf(cl, "OK next reset at %u\n", rsttime);
+}
+
+/** Handles one command line
+ * @retval 0   close the connection */
+static int bcnt_ctl_command(rlm_backcounter_t *data, struct bcnt_ctl_client *cl, char *line)
+{
+	char *cmd, *user, *arg, *arg2, *save = NULL;
+	struct bcnt_conn *conn;
+	int r;
+
+	cmd  = strtok_r(line, " \t\r", &save);
+	user = strtok_r(NULL, " \t\r", &save);
+	arg  = strtok_r(NULL, " \t\r", &save);
+	arg2 = strtok_r(NULL, " \t\r", &save);
+
+	if (!cmd) {
+		return 1;
+	}
+	else if (strcmp(cmd, "quit") == 0) {
+		return 0;
+	}
+	else if (strcmp(cmd, "help") == 0) {
+		return bcnt_ctl_printf(cl,
+			"topup <user> <amount> [dimension] add amount to user's prepaid counter\n"
+			"reset <user>            reset user's counter now\n"
+			"dump <user>             show user's counters\n"
+			"invalidate <user>       forget what is cached for user\n"
+			"invalidate-all          forget what is cached for all users\n"
+			"invalidate-group [group] forget cached limit of group, or of all groups\n"
+			"stats [interval]        show statistics, each interval seconds if given\n"
+			"quit                    close connection\n"
+			"OK\n");
+	}
+	else if (strcmp(cmd, "stats") == 0) {
+		if (user) {
+			cl->interval = atoi(user);
+			cl->next = time(NULL) + cl->interval;
+		}
+		return bcnt_ctl_stats(data, cl);
+	}
+	else if (strcmp(cmd, "invalidate-all") == 0) {
+		return bcnt_ctl_printf(cl, "OK %d\n", bcnt_invalidate(data, NULL));
+	}
+	else if (strcmp(cmd, "invalidate-group") == 0) {
+		/* no user name here, but a group name (if any) */
+		return bcnt_ctl_printf(cl, "OK %d\n", bcnt_invalidate_group(data, user));
+	}
+	else if (strcmp(cmd, "topup") && strcmp(cmd, "reset") &&
+	         strcmp(cmd, "dump") && strcmp(cmd, "invalidate")) {
+		return bcnt_ctl_printf(cl, "ERR unknown command, try 'help'\n");
+	}
+
+	/* commands below need user name */
+	if (!bcnt_user_ok(user))
+		return bcnt_ctl_printf(cl, "ERR invalid user name\n");
+
+	if (strcmp(cmd, "invalidate") == 0)
+		return bcnt_ctl_printf(cl, "OK %d\n", bcnt_invalidate(data, user));
+
+	/* ...and db */
+	conn = bcnt_conn_get(data);
+	if (!conn) {
+		bcnt_log(L_ERR, "error while requesting an SQL socket");
+		return bcnt_ctl_printf(cl, "ERR database error\n");
+	}
+
+	if (strcmp(cmd, "topup") == 0)
+		r = bcnt_ctl_topup(data, cl, conn, user, arg, arg2);
+	else if (strcmp(cmd, "reset") == 0)
+		r = bcnt_ctl_reset(data, cl, conn, user);
+	else
+		r = bcnt_ctl_dump(data, cl, conn, user);
+
+	bcnt_conn_release(data, conn);
+	return r;
+}
+
+/** Reads from client and handles complete command lines
+ * @retval 0   close the connection */
+static int bcnt_ctl_read(rlm_backcounter_t *data, struct bcnt_ctl_client *cl)
+{
+	ssize_t r;
+	char *eol;
+
+	r = recv(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - cl->len - 1, 0);
+	if (r <= 0)
+		return 0;
+
+	cl->len += r;
+	cl->buf[cl->len] = '\0';
+
+	while ((eol = strchr(cl->buf, '\n'))) {
+		*eol = '\0';
+
+		if (!bcnt_ctl_command(data, cl, cl->buf))
+			return 0;
+
+		cl->len -= eol + 1 - cl->buf;
+		memmove(cl->buf, eol + 1, cl->len + 1);
+	}
+
+	/* line too long */
+	if (cl->len == sizeof(cl->buf) - 1) {
+		bcnt_ctl_printf(cl, "ERR line too long\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/** Control socket thread: serves all clients, so RADIUS threads never wait for it */
+static void *bcnt_ctl_thread(void *arg)
+{
+	rlm_backcounter_t *data = arg;
+	struct bcnt_ctl_client clients[RLM_BC_CTL_CLIENTS];
+	struct pollfd pfd[RLM_BC_CTL_CLIENTS + 2];
+	int map[RLM_BC_CTL_CLIENTS + 2];
+	int i, n, fd, timeout;
+	time_t now;
+
+	for (i = 0; i < RLM_BC_CTL_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	for (;;) {
+		/* wake-up pipe and listening socket go first */
+		pfd[0].fd = data->ctl_pipe[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = data->ctl_fd;
+		pfd[1].events = POLLIN;
+		n = 2;
+
+		timeout = -1;
+		for (i = 0; i < RLM_BC_CTL_CLIENTS; i++) {
+			if (clients[i].fd < 0)
+				continue;
+
+			if (clients[i].interval > 0)
+				timeout = 1000;
+
+			pfd[n].fd = clients[i].fd;
+			pfd[n].events = POLLIN;
+			map[n++] = i;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			bcnt_log(L_ERR, "control socket: poll(): %s", strerror(errno));
+			break;
+		}
+
+		/* backcounter_detach() wants us to stop */
+		if (pfd[0].revents)
+			break;
+
+		/* new connection */
+		if (pfd[1].revents & POLLIN) {
+			fd = accept(data->ctl_fd, NULL, NULL);
+
+			for (i = 0; fd >= 0 && i < RLM_BC_CTL_CLIENTS; i++) {
+				if (clients[i].fd >= 0)
+					continue;
+
+				memset(&clients[i], 0, sizeof(clients[i]));
+				clients[i].fd = fd;
+				fd = -1;
+			}
+
+			if (fd >= 0) {
+				send(fd, "ERR too many clients\n", 21, MSG_NOSIGNAL);
+				close(fd);
+			}
+		}
+
+		/* commands */
+		for (i = 2; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+
+			if (!bcnt_ctl_read(data, &clients[map[i]])) {
+				close(clients[map[i]].fd);
+				clients[map[i]].fd = -1;
+			}
+		}
+
+		/* stats streams */
+		now = time(NULL);
+		for (i = 0; i < RLM_BC_CTL_CLIENTS; i++) {
+			if (clients[i].fd < 0 || clients[i].interval <= 0 || now < clients[i].next)
+				continue;
+
+			clients[i].next = now + clients[i].interval;
+			if (!bcnt_ctl_stats(data, &clients[i])) {
+				close(clients[i].fd);
+				clients[i].fd = -1;
+			}
+		}
+	}
+
+	for (i = 0; i < RLM_BC_CTL_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			close(clients[i].fd);
+
+	return NULL;
+}
+
+/** Opens control socket and starts its thread
+ * @retval 0   error
+ * @retval 1   success */
+static int bcnt_ctl_start(rlm_backcounter_t *data)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	char tmppath[sizeof(sa.sun_path)];
+
+	if (snprintf(tmppath, sizeof(tmppath), "%s.new", data->control_socket) >= (int) sizeof(tmppath)) {
+		bcnt_log(L_ERR, "control socket path too long: %s", data->control_socket);
+		return 0;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, tmppath);
+
+	data->ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (data->ctl_fd < 0) {
+		bcnt_log(L_ERR, "control socket: socket(): %s", strerror(errno));
+		return 0;
+	}
+
+	/* bind under temporary name and move it in place, so on HUP the socket of
+	 * the old instance stays until the new one is ready */
+	unlink(tmppath);
+	if (bind(data->ctl_fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 ||
+	    chmod(tmppath, 0600) < 0 ||
+	    listen(data->ctl_fd, 8) < 0 ||
+	    stat(tmppath, &st) < 0 ||
+	    rename(tmppath, data->control_socket) < 0) {
+		bcnt_log(L_ERR, "control socket %s: %s", data->control_socket, strerror(errno));
+		unlink(tmppath);
+		close(data->ctl_fd);
+		data->ctl_fd = -1;
+		return 0;
+	}
+	data->ctl_ino = st.st_ino;
+
+	if (pipe(data->ctl_pipe) < 0) {
+		bcnt_log(L_ERR, "control socket: pipe(): %s", strerror(errno));
+		close(data->ctl_fd);
+		data->ctl_fd = -1;
+		return 0;
+	}
+
+	if (pthread_create(&data->ctl_thread, NULL, bcnt_ctl_thread, data) != 0) {
+		bcnt_log(L_ERR, "control socket: couldn't start thread");
+		close(data->ctl_pipe[0]);
+		close(data->ctl_pipe[1]);
+		close(data->ctl_fd);
+		data->ctl_fd = -1;
+		return 0;
+	}
+
+	bcnt_log(L_INFO, "listening on control socket %s", data->control_socket);
+	return 1;
+}
+
+/** Stops control socket thread and closes the socket */
+static void bcnt_ctl_stop(rlm_backcounter_t *data)
+{
+	struct stat st;
+
+	if (data->ctl_fd < 0)
+		return;
+
+	if (write(data->ctl_pipe[1], "", 1) == 1)
+		pthread_join(data->ctl_thread, NULL);
+
+	close(data->ctl_pipe[0]);
+	close(data->ctl_pipe[1]);
+	close(data->ctl_fd);
+	data->ctl_fd = -1;
+
+	/* don't remove the socket of a newer instance */
+	if (stat(data->control_socket, &st) == 0 && st.st_ino == data->ctl_ino)
+		unlink(data->control_socket);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* indexes the queries above need, created if schema_indexes is set */
+static const struct bcnt_index {
+	const char *table;
+	const char *covering;       /* index with all the columns queries read */
+	const char *fallback;       /* used if the covering one can't be created */
+} bcnt_indexes[] = {
+	{ "radreply",
+	  "CREATE INDEX `bcnt_user_attr` ON `radreply` (`UserName`, `Attribute`, `Value`)",
+	  "CREATE INDEX `bcnt_user_attr` ON `radreply` (`UserName`, `Attribute`)" },
+	{ "usergroup",
+	  "CREATE INDEX `bcnt_user_prio` ON `usergroup` (`UserName`, `priority`, `GroupName`)",
+	  NULL },
+	{ "radgroupreply",
+	  "CREATE INDEX `bcnt_group_attr` ON `radgroupreply` (`GroupName`, `Attribute`, `Value`)",
+	  "CREATE INDEX `bcnt_group_attr` ON `radgroupreply` (`GroupName`, `Attribute`)" },
+	{ NULL, NULL, NULL }
+};
+
+/** Creates index needed by our queries on given table
+ * @retval 0   error or unknown table
+ * @retval 1   success */
+static int bcnt_create_index(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *table)
+{
+	const struct bcnt_index *idx;
+
+	for (idx = bcnt_indexes; idx->table; idx++) {
+		if (strcasecmp(idx->table, table) != 0)
+			continue;
+
+		bcnt_log(L_INFO, "creating index on table %s", table);
+
+		if (bcnt_query(__LINE__, data, conn, "%s", idx->covering) ||
+		    (idx->fallback && bcnt_query(__LINE__, data, conn, "%s", idx->fallback))) {
+			bcnt_finish(data, conn);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	bcnt_log(L_ERR, "don't know what index to create on table %s", table);
+	return 0;
+}
+
+/* instances whose schema was checked already, so it isn't done again on HUP */
+static struct bcnt_checked {
+	struct bcnt_checked *next;
+	char name[1];               /* instance name (allocated together with struct) */
+} *bcnt_schema_checked;
+
+/** Tells if schema of given instance was checked, marking it as such
+ * Only called from instantiate, which runs in one thread. */
+static int bcnt_schema_seen(const char *name)
+{
+	struct bcnt_checked *c;
+	size_t len;
+
+	for (c = bcnt_schema_checked; c; c = c->next)
+		if (strcmp(c->name, name) == 0)
+			return 1;
+
+	len = strlen(name);
+	c = rad_malloc(sizeof(*c) + len);
+	memcpy(c->name, name, len + 1);
+	c->next = bcnt_schema_checked;
+	bcnt_schema_checked = c;
+
+	return 0;
+}
+
+/** Checks that our queries don't scan whole tables, creating indexes if asked to
+ * @retval 0   found scans and schema_check is "fail", or db error
+ * @retval 1   success */
+static int bcnt_schema_check(rlm_backcounter_t *data)
+{
+	struct bcnt_conn *conn;
+	char query[MAX_QUERY_LEN];
+	char table[MAX_STRING_LEN];
+	const char *site;
+	struct bcnt_args args = { "bcnt-schema-check", "bcnt-schema-check", NULL, "0", NULL };
+	static const int checked[] = { BCNT_Q_RESET, BCNT_Q_GROUP_LIMIT, BCNT_Q_USER_GROUPS,
+	                               BCNT_Q_GROUP_VALUE, BCNT_Q_COUNTERS, BCNT_Q_UPDATE };
+	unsigned int i;
+	int q, r, scans = 0;
+
+	conn = bcnt_conn_get(data);
+	if (!conn) {
+		bcnt_log(L_ERR, "error while requesting an SQL socket");
+		return (strcmp(data->schema_check, "fail") != 0);
+	}
+
+	for (i = 0; i < sizeof(checked) / sizeof(checked[0]); i++) {
+		q = checked[i];
+
+		/* group limits come either from one join, or from the cached queries */
+		if (data->group_cache_ttl > 0 ? q == BCNT_Q_GROUP_LIMIT :
+		    (q == BCNT_Q_USER_GROUPS || q == BCNT_Q_GROUP_VALUE))
+			continue;
+
+		args.attr = (q == BCNT_Q_RESET) ? data->resetvap :
+		            (q == BCNT_Q_UPDATE) ? data->main.leftvap : data->main.limitvap;
+
+		if (bcnt_tpl_render(data, data->tpl[q], &args, query, sizeof(query)) < 0)
+			continue;
+		site = bcnt_query_defs[q].name;
+
+		table[0] = '\0';
+		r = (data->backend->explain)(data, conn, site, query, table, sizeof(table));
+
+		if (r == 1 && data->schema_indexes && bcnt_create_index(data, conn, table)) {
+			table[0] = '\0';
+			r = (data->backend->explain)(data, conn, site, query, table, sizeof(table));
+		}
+
+		if (r < 0) {
+			/* eg. EXPLAIN UPDATE is not supported by older MySQL */
+			bcnt_log(L_INFO, "couldn't check plan of %s", site);
+		}
+		else if (r > 0) {
+			bcnt_log(L_ERR, "%s scans whole table %s - consider adding an index "
+			         "(or set schema_indexes = yes)", site, table);
+			scans++;
+		}
+	}
+
+	bcnt_conn_release(data, conn);
+
+	return (scans == 0 || strcmp(data->schema_check, "fail") != 0);
+}
+
+/*
+ * Counter dimensions
+ */
+
+/** Parses count_names and guard attributes of dimension
+ * @retval 0   error */
+static int bcnt_dim_init(rlm_backcounter_t *data, struct bcnt_dim *dim)
+{
+	int i, c, l, a;
+	DICT_ATTR *dattr;
+
+	/* convert count_names to attributes */
+	c = 1;
+	l = strlen(dim->count_names);
+
+	/* convert commas and spaces to \0, count number of attributes in c */
+	for (i = 0; i < l; i++) {
+		if (dim->count_names[i] == ',' || dim->count_names[i] == ' ') {
+			c++;
+			while (i < l && (dim->count_names[i] < 'A' || dim->count_names[i] > 'Z'))
+				dim->count_names[i++] = '\0';
 		}
 	}
 
 	/* parse attribute names into count_attrs array */
 	a = 0;
-	data->count_attrs = rad_malloc(sizeof(int) * (c + 1));
-	if (!data->count_attrs) {
-		backcounter_detach(*instance);
-		return -1;
-	}
+	dim->count_attrs = rad_malloc(sizeof(struct bcnt_count) * (c + 1));
+	if (!dim->count_attrs)
+		return 0;
 
 	for (i = 0; i < l; ) {
-		dattr = dict_attrbyname(data->count_names + i);
+		dattr = dict_attrbyname(dim->count_names + i);
 		if (dattr == NULL) {
-			bcnt_log(L_ERR, "can't parse count_names argument name: %s", data->count_names + i);
-			backcounter_detach(*instance);
-			return -1;
+			bcnt_log(L_ERR, "dimension %s: can't parse count_names argument name: %s",
+			         dim->name, dim->count_names + i);
+			return 0;
+		}
+
+		dim->count_attrs[a].attr = dattr->attr;
+		dim->count_attrs[a].slot = bcnt_plan_slot(data, dattr->attr);
+
+		/* pair octet counters with their Gigawords */
+		switch (dattr->attr) {
+			case PW_ACCT_INPUT_OCTETS:
+				dim->count_attrs[a].giga = bcnt_plan_slot(data, PW_ACCT_INPUT_GIGAWORDS);
+				break;
+			case PW_ACCT_OUTPUT_OCTETS:
+				dim->count_attrs[a].giga = bcnt_plan_slot(data, PW_ACCT_OUTPUT_GIGAWORDS);
+				break;
+			default:
+				dim->count_attrs[a].giga = -1;
+				break;
+		}
+
+		/* all dimensions share one extraction plan */
+		if (dim->count_attrs[a].slot < 0) {
+			bcnt_log(L_ERR, "too many attributes in count_names (max. %d in all dimensions)",
+			         RLM_BC_MAX_SLOTS - BCNT_SLOT_FIXED);
+			return 0;
 		}
 
-		data->count_attrs[a++] = dattr->attr;
-		if (a == c) break;
+		if (++a == c) break;
 
 		/* advance to next attribute name */
-		i += strlen(data->count_names + i);
-		while (data->count_names[i] == '\0' && i < l) i++;
+		i += strlen(dim->count_names + i);
+		while (dim->count_names[i] == '\0' && i < l) i++;
 	}
 
 	/* array end guard */
-	data->count_attrs[a] = 0;
+	dim->count_attrs[a].attr = 0;
 
-	if (data->overvap && data->overvap[0]) {
-		dattr = dict_attrbyname(data->overvap);
+	if (dim->guardvap && dim->guardvap[0]) {
+		dattr = dict_attrbyname(dim->guardvap);
 		if (dattr == NULL) {
-			bcnt_log(L_ERR, "overvap: can't find such attribute: %s", data->overvap);
-			backcounter_detach(*instance);
-			return -1;
+			bcnt_log(L_ERR, "dimension %s: guardvap: can't find such attribute: %s",
+			         dim->name, dim->guardvap);
+			return 0;
 		}
-		data->overvap_attr = dattr->attr;
+		dim->guardvap_attr = dattr->attr;
 	}
 	else {
-		data->overvap_attr = 0;
+		dim->guardvap_attr = 0;
 	}
 
-	if (data->guardvap && data->guardvap[0]) {
-		dattr = dict_attrbyname(data->guardvap);
+	if (dim->giga_guardvap && dim->giga_guardvap[0]) {
+		dattr = dict_attrbyname(dim->giga_guardvap);
 		if (dattr == NULL) {
-			bcnt_log(L_ERR, "guardvap: can't find such attribute: %s", data->guardvap);
-			backcounter_detach(*instance);
-			return -1;
+			bcnt_log(L_ERR, "dimension %s: giga_guardvap: can't find such attribute: %s",
+			         dim->name, dim->giga_guardvap);
+			return 0;
 		}
-		data->guardvap_attr = dattr->attr;
+		dim->giga_guardvap_attr = dattr->attr;
 	}
 	else {
-		data->guardvap_attr = 0;
+		dim->giga_guardvap_attr = 0;
+	}
+
+	return 1;
+}
+
+/** Frees what dimension points to, but not the dimension */
+static void bcnt_dim_free(struct bcnt_dim *dim)
+{
+	if (dim->count_names)   free(dim->count_names);
+	if (dim->count_attrs)   free(dim->count_attrs);
+	if (dim->leftvap)       free(dim->leftvap);
+	if (dim->limitvap)      free(dim->limitvap);
+	if (dim->prepaidvap)    free(dim->prepaidvap);
+	if (dim->guardvap)      free(dim->guardvap);
+	if (dim->giga_guardvap) free(dim->giga_guardvap);
+}
+
+/** Appends quoted attribute name to comma-separated list in *list */
+static void bcnt_dim_list(char **list, const char *attr)
+{
+	size_t len = *list ? strlen(*list) : 0;
+	char *p;
+
+	if (!*attr)
+		return;
+
+	p = rad_malloc(len + strlen(attr) + 5);
+	sprintf(p, "%s%s'%s'", len ? *list : "", len ? ", " : "", attr);
+
+	free(*list);
+	*list = p;
+}
+
+/** Sets up dimensions: main, then "dimension" subsections of conf
+ * @retval 0   error */
+static int bcnt_dims_init(rlm_backcounter_t *data, CONF_SECTION *conf)
+{
+	CONF_SECTION *cs;
+	struct bcnt_dim *dim;
+	int i, c = 1;
+
+	for (cs = NULL; (cs = cf_subsection_find_next(conf, cs, "dimension")) != NULL; )
+		c++;
+
+	if (c > RLM_BC_MAX_DIMS) {
+		bcnt_log(L_ERR, "too many dimensions (max. %d with main)", RLM_BC_MAX_DIMS);
+		return 0;
+	}
+
+	data->dims = rad_malloc(sizeof(struct bcnt_dim *) * c);
+	data->dims[data->dims_count++] = &data->main;
+	data->main.name = "main";
+
+	if (!bcnt_dim_init(data, &data->main))
+		return 0;
+
+	for (cs = NULL; (cs = cf_subsection_find_next(conf, cs, "dimension")) != NULL; ) {
+		dim = rad_malloc(sizeof(*dim));
+		memset(dim, 0, sizeof(*dim));
+		data->dims[data->dims_count++] = dim; /* so backcounter_detach() frees it */
+
+		dim->name = cf_section_name2(cs);
+		if (!dim->name) {
+			bcnt_log(L_ERR, "dimension without a name");
+			return 0;
+		}
+
+		for (i = 0; i < data->dims_count - 1; i++) {
+			if (strcmp(data->dims[i]->name, dim->name) == 0) {
+				bcnt_log(L_ERR, "duplicate dimension %s", dim->name);
+				return 0;
+			}
+		}
+
+		if (cf_section_parse(cs, dim, dimension_config) < 0)
+			return 0;
+
+		if (!*dim->count_names || !*dim->leftvap || !*dim->limitvap) {
+			bcnt_log(L_ERR, "dimension %s: count_names, leftvap and limitvap must be set",
+			         dim->name);
+			return 0;
+		}
+
+		if (!bcnt_dim_init(data, dim))
+			return 0;
+	}
+
+	/* for %A and %M */
+	for (i = 0; i < data->dims_count; i++) {
+		bcnt_dim_list(&data->all_counters, data->dims[i]->leftvap);
+		bcnt_dim_list(&data->all_counters, data->dims[i]->prepaidvap);
+		bcnt_dim_list(&data->all_limits, data->dims[i]->limitvap);
+	}
+
+	/* otherwise authorize and accounting wouldn't see other dimensions */
+	if (data->dims_count > 1 && !bcnt_tpl_uses(data->tpl[BCNT_Q_COUNTERS], 'A')) {
+		bcnt_log(L_ERR, "counters_query must use %%A with dimensions");
+		return 0;
+	}
+
+	return 1;
+}
+
+/** Cleanup stuff */
+static int backcounter_detach(void *instance)
+{
+	rlm_backcounter_t *data;
+	struct bcnt_level *level, *next_level;
+	int i;
+
+	if (instance == NULL)
+		return 0;
+
+	data = (rlm_backcounter_t *) instance;
+
+#ifdef HAVE_PTHREAD_H
+	bcnt_ctl_stop(data);
+	bcnt_rollup_stop(data);
+#endif
+
+	/* write pending rollups while the backend is still there */
+	if (data->rollup && data->backend_ready)
+		bcnt_rollup_tick(data, 1);
+
+	if (data->backend_ready)
+		(data->backend->detach)(data);
+
+	/* (*data) is zeroed on instantiation */
+	if (data->backend_name)  free(data->backend_name);
+	if (data->sqlinst_name)  free(data->sqlinst_name);
+	if (data->sqlite_file)   free(data->sqlite_file);
+	if (data->sql_health_query) free(data->sql_health_query);
+	if (data->resetvap)      free(data->resetvap);
+	if (data->overvap)       free(data->overvap);
+	if (data->rollup_table)  free(data->rollup_table);
+	if (data->control_socket) free(data->control_socket);
+	if (data->schema_check)  free(data->schema_check);
+	if (data->event_log)     free(data->event_log);
+
+	if (data->event_fd >= 0)
+		close(data->event_fd);
+
+	if (data->event_users) {
+		for (i = 0; i < RLM_BC_EVENT_USERS; i++)
+			if (data->event_users[i].user)
+				free(data->event_users[i].user);
+		free(data->event_users);
+		pthread_mutex_destroy(&data->event_mutex);
+	}
+
+	bcnt_cache_free(&data->group_limits);
+	bcnt_cache_free(&data->user_groups);
+	bcnt_cache_free(&data->overlimit);
+
+	/* dims[0] is data->main */
+	bcnt_dim_free(&data->main);
+	for (i = 1; i < data->dims_count; i++) {
+		bcnt_dim_free(data->dims[i]);
+		free(data->dims[i]);
+	}
+	if (data->dims)          free(data->dims);
+	if (data->all_counters)  free(data->all_counters);
+	if (data->all_limits)    free(data->all_limits);
+
+	for (i = 0; i < BCNT_Q_COUNT; i++) {
+		if (data->tpl[i])        free(data->tpl[i]);
+		if (data->query_text[i]) free(data->query_text[i]);
+	}
+
+	/* whatever the final flush above couldn't write */
+	if (data->rollup) {
+		if (fr_hash_table_num_elements(data->rollup) > 0)
+			bcnt_log(L_ERR, "dropping %d pending rollup buckets",
+			         fr_hash_table_num_elements(data->rollup));
+		fr_hash_table_free(data->rollup);
+		pthread_mutex_destroy(&data->rollup_mutex);
 	}
 
-	if (data->giga_guardvap && data->giga_guardvap[0]) {
-		dattr = dict_attrbyname(data->giga_guardvap);
+	/* free levels */
+	level = data->levels;
+	while (level) {
+		next_level = level->next;
+		free(level);
+		level = next_level;
+	}
+
+	free(data);
+
+	return 0;
+}
+
+/** Does initialization */
+static int backcounter_instantiate(CONF_SECTION *conf, void **instance)
+{
+	rlm_backcounter_t *data;
+	int i;
+	struct bcnt_level *last = NULL, *level;
+	DICT_ATTR *dattr;
+	struct lp_data lp;
+
+	/* set up a storage area for instance data */
+	data = rad_malloc(sizeof(*data));
+	if (!data) return -1;
+	memset(data, 0, sizeof(*data)); /* so backcounter_detach will know what to free */
+	data->ctl_fd = -1;
+	data->event_fd = -1;
+
+	/* fail if the configuration parameters can't be parsed */
+	if (cf_section_parse(conf, data, module_config) < 0) {
+		backcounter_detach(data);
+		return -1;
+	}
+
+	/* save my name */
+	data->myname = cf_section_name2(conf);
+	if (!data->myname)
+		data->myname = "(no name)";
+
+	data->xlat_name = cf_section_name2(conf);
+	if (!data->xlat_name)
+		data->xlat_name = cf_section_name1(conf);
+
+	/* find storage backend */
+	for (i = 0; bcnt_backends[i]; i++) {
+		if (strcmp(bcnt_backends[i]->name, data->backend_name) == 0)
+			break;
+	}
+
+	if (!bcnt_backends[i]) {
+		bcnt_log(L_ERR, "unknown backend \"%s\"", data->backend_name);
+		backcounter_detach(data);
+		return -1;
+	}
+
+	data->backend = bcnt_backends[i];
+
+	/* compile query templates */
+	for (i = 0; i < BCNT_Q_COUNT; i++) {
+		data->tpl[i] = bcnt_tpl_compile(data, i,
+			*data->query_text[i] ? data->query_text[i] : data->backend->queries[i]);
+
+		if (!data->tpl[i]) {
+			backcounter_detach(data);
+			return -1;
+		}
+	}
+
+	/* prepare caches */
+	if (data->cache_size < 1) {
+		bcnt_log(L_ERR, "cache_size must be positive");
+		backcounter_detach(data);
+		return -1;
+	}
+
+	if (!bcnt_cache_init(data, &data->group_limits, "group limit", data->group_cache_ttl) ||
+	    !bcnt_cache_init(data, &data->user_groups, "user groups", data->user_group_cache_ttl) ||
+	    !bcnt_cache_init(data, &data->overlimit, "over limit", data->overlimit_cache_ttl)) {
+		backcounter_detach(data);
+		return -1;
+	}
+
+	if (data->user_group_cache_ttl > 0 && data->group_cache_ttl <= 0)
+		bcnt_log(L_INFO, "user_group_cache_ttl has no effect without group_cache_ttl");
+
+	/* fixed slots of the extraction plan go first */
+	bcnt_plan_slot(data, PW_ACCT_STATUS_TYPE);
+	bcnt_plan_slot(data, PW_ACCT_SESSION_TIME);
+	bcnt_plan_slot(data, PW_ACCT_DELAY_TIME);
+
+	/* counter dimensions */
+	if (!bcnt_dims_init(data, conf)) {
+		backcounter_detach(data);
+		return -1;
+	}
+
+	if (data->overvap && data->overvap[0]) {
+		dattr = dict_attrbyname(data->overvap);
 		if (dattr == NULL) {
-			bcnt_log(L_ERR, "giga_guardvap: can't find such attribute: %s", data->giga_guardvap);
-			backcounter_detach(*instance);
+			bcnt_log(L_ERR, "overvap: can't find such attribute: %s", data->overvap);
+			backcounter_detach(data);
 			return -1;
 		}
-		data->giga_guardvap_attr = dattr->attr;
+		data->overvap_attr = dattr->attr;
 	}
 	else {
-		data->giga_guardvap_attr = 0;
+		data->overvap_attr = 0;
 	}
 
 	/*
@@ -513,14 +4214,23 @@ static int backcounter_instantiate(CONF_SECTION *conf, void **instance)
 		while (lp.next) {
 			level = rad_malloc(sizeof(*level));
 			if (!level) {
-				backcounter_detach(*instance);
+				backcounter_detach(data);
 				return -1;
 			}
+			memset(level, 0, sizeof(*level));
+
+			/* update list (so backcounter_detach() frees it on errors below) */
+			if (!data->levels)
+				data->levels = level;
+			else if (last)
+				last->next = level;
+
+			last = level;
 
 			do {
 				if (!bcnt_levels_parser(lp.next, &lp)) {
 					bcnt_log(L_ERR, "parse error in 'levels' option");
-					backcounter_detach(*instance);
+					backcounter_detach(data);
 					return -1;
 				}
 
@@ -528,54 +4238,363 @@ static int backcounter_instantiate(CONF_SECTION *conf, void **instance)
 					case LK_FROM: level->from   = lp.value_int; break;
 					case LK_EACH: level->each   = lp.value_int; break;
 					case LK_FOR:  level->length = lp.value_int; break;
-					case LK_USE:  level->factor = lp.value_double; break;
+					case LK_USE:  level->factor = lp.value_fixed; break;
 					case LK_END:  break;
 				}
 			} while (lp.keyword != LK_END);
 
 			bcnt_log(L_DBG, "loaded level from %d each %d for %d use %g\n",
-				level->from, level->each, level->length, level->factor);
+				level->from, level->each, level->length,
+				(double) level->factor / RLM_BC_FP_ONE);
 
-			if (level->each < level->length) {
-				bcnt_log(L_ERR, "level period repetition is smaller than its length");
-				backcounter_detach(*instance);
+			if (level->factor > RLM_BC_FP_MAX) {
+				bcnt_log(L_ERR, "level factor greater than 1000");
+				backcounter_detach(data);
 				return -1;
 			}
 
-			/* update list */
-			if (!data->levels)
-				data->levels = level;
-			else if (last)
-				last->next = level;
+			if (level->each == 0 || level->each < level->length) {
+				bcnt_log(L_ERR, "level period repetition is zero or smaller than its length");
+				backcounter_detach(data);
+				return -1;
+			}
+		}
+	}
 
-			last = level;
+	/*
+	 * event log
+	 */
+	if (data->event_log && *data->event_log) {
+		if (data->event_log_burst < 1 || data->event_log_interval < 1) {
+			bcnt_log(L_ERR, "event_log_burst and event_log_interval must be positive");
+			backcounter_detach(data);
+			return -1;
+		}
+
+		data->event_fd = open(data->event_log, O_WRONLY | O_APPEND | O_CREAT, 0640);
+		if (data->event_fd < 0) {
+			bcnt_log(L_ERR, "event log %s: %s", data->event_log, strerror(errno));
+			backcounter_detach(data);
+			return -1;
 		}
+
+		data->event_users = rad_malloc(sizeof(struct bcnt_event_user) * RLM_BC_EVENT_USERS);
+		memset(data->event_users, 0, sizeof(struct bcnt_event_user) * RLM_BC_EVENT_USERS);
+		pthread_mutex_init(&data->event_mutex, NULL);
 	}
 
-	/* save pointers to useful "objects" */
-	data->sqlinst = (SQL_INST *) modinst->insthandle;
-	data->db = (rlm_sql_module_t *) data->sqlinst->module;
+	/*
+	 * rollups
+	 */
+	if (data->rollup_table && *data->rollup_table) {
+		if (data->rollup_interval < 1 || data->rollup_size < 1) {
+			bcnt_log(L_ERR, "rollup_interval and rollup_size must be positive");
+			backcounter_detach(data);
+			return -1;
+		}
+
+		data->rollup = fr_hash_table_create(bcnt_rollup_hash, bcnt_rollup_cmp, free);
+		if (!data->rollup) {
+			bcnt_log(L_ERR, "couldn't create rollup table");
+			backcounter_detach(data);
+			return -1;
+		}
+
+		pthread_mutex_init(&data->rollup_mutex, NULL);
+		data->rollup_flushed = time(NULL);
+	}
+
+	/* connect to storage */
+	if (!(data->backend->init)(data)) {
+		backcounter_detach(data);
+		return -1;
+	}
+	data->backend_ready = 1;
+
+	/* verify that the database can run our queries efficiently (on startup, not on HUP) */
+	if (strcmp(data->schema_check, "no") != 0) {
+		if (strcmp(data->schema_check, "warn") != 0 && strcmp(data->schema_check, "fail") != 0) {
+			bcnt_log(L_ERR, "schema_check: must be \"no\", \"warn\" or \"fail\"");
+			backcounter_detach(data);
+			return -1;
+		}
+
+		if (!bcnt_schema_seen(data->myname) && !bcnt_schema_check(data)) {
+			bcnt_log(L_ERR, "schema check failed");
+			backcounter_detach(data);
+			return -1;
+		}
+	}
+
+	if (data->control_socket && *data->control_socket) {
+#ifdef HAVE_PTHREAD_H
+		if (!bcnt_ctl_start(data)) {
+			backcounter_detach(data);
+			return -1;
+		}
+#else
+		bcnt_log(L_ERR, "control socket requires thread support");
+		backcounter_detach(data);
+		return -1;
+#endif
+	}
+
+	/* without threads, rollups are flushed by Stop packets only */
+#ifdef HAVE_PTHREAD_H
+	if (data->rollup && !bcnt_rollup_start(data)) {
+		backcounter_detach(data);
+		return -1;
+	}
+#endif
 
 	*instance = data;
 
+	/* on HUP this takes over the xlat from the previous instance, hence it's
+	 * not unregistered in backcounter_detach() */
+	xlat_register(data->xlat_name, backcounter_xlat, data);
+
 	bcnt_log(L_INFO, "rlm_backcounter " RLM_BC_VERSION " initialized");
 	return 0;
 }
 
+/** Fetches leftvaps and prepaidvaps of all dimensions in one query
+ * @param st               array of data->dims_count states, zeroed by caller
+ * @retval -1  user has no counters
+ * @retval  0  db error
+ * @retval  1  success */
+static int bcnt_counters(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *user,
+                         struct bcnt_dim_state *st)
+{
+	struct bcnt_dim *dim;
+	int i, r;
+
+	r = bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_COUNTERS, user, NULL);
+	if (r < 1)
+		return r;
+
+	do {
+		if (!conn->row[0] || !conn->row[1])
+			continue;
+
+		for (i = 0; i < data->dims_count; i++) {
+			dim = data->dims[i];
+
+			if (strcasecmp(conn->row[0], dim->leftvap) == 0) {
+				st[i].left = bcnt_add(st[i].left, bcnt_parse(conn->row[1]));
+				st[i].has_left = 1;
+				break;
+			}
+
+			if (*dim->prepaidvap && strcasecmp(conn->row[0], dim->prepaidvap) == 0) {
+				st[i].prepaid = bcnt_add(st[i].prepaid, bcnt_parse(conn->row[1]));
+				st[i].has_prepaid = 1;
+				break;
+			}
+		}
+	} while (bcnt_select_next(data, conn));
+
+	bcnt_select_finish(data, conn);
+	return 1;
+}
+
+/** Sets guardvap (and giga_guardvap) of dimension in reply to counter
+ * If the reply has it already (e.g. Session-Timeout from levels, or another
+ * dimension's guardvap), the smaller value is kept instead of adding another. */
+static void bcnt_guard(REQUEST *request, const struct bcnt_dim *dim, int64_t counter)
+{
+	VALUE_PAIR *vp, *giga = NULL;
+	int64_t old;
+	uint32_t high;
+
+	vp = pairfind(request->reply->vps, dim->guardvap_attr);
+	if (vp && dim->giga_guardvap_attr)
+		giga = pairfind(request->reply->vps, dim->giga_guardvap_attr);
+
+	if (vp) {
+		old = vp->vp_integer;
+		if (giga)
+			old |= (int64_t) giga->vp_integer << 32;
+
+		if (old <= counter)
+			return;
+	}
+	else {
+		vp = radius_paircreate(request, &request->reply->vps,
+		                       dim->guardvap_attr, PW_TYPE_INTEGER);
+	}
+
+	if (counter > UINT32_MAX && dim->giga_guardvap_attr && !giga)
+		giga = radius_paircreate(request, &request->reply->vps,
+		                         dim->giga_guardvap_attr, PW_TYPE_INTEGER);
+
+	/* without giga_guardvap, set the maximum possible value */
+	vp->vp_integer = bcnt_split(counter, giga ? &high : NULL);
+	if (giga)
+		giga->vp_integer = high;
+}
+
+/** Sums values of dimension's count_names in accounting packet */
+static int64_t bcnt_dim_sum(rlm_backcounter_t *data, const struct bcnt_dim *dim, VALUE_PAIR **slots)
+{
+	int64_t sum = 0;
+	uint64_t val;
+	int i;
+
+	for (i = 0; dim->count_attrs[i].attr; i++) {
+		if (!slots[dim->count_attrs[i].slot]) {
+			bcnt_log(L_DBG, "couldn't find attribute #%u to subtract from counters",
+			         dim->count_attrs[i].attr);
+		}
+		else {
+			val = bcnt_count_value(data, &dim->count_attrs[i], slots);
+			sum = bcnt_add(sum, (val > INT64_MAX) ? INT64_MAX : (int64_t) val);
+		}
+	}
+
+	return sum;
+}
+
+/** Subtracts sum from user's counters of dimension and stores them
+ * @retval -1  db error
+ * @retval  0  nothing to do: no limits, or limit already reached
+ * @retval  1  counters updated */
+static int bcnt_charge(rlm_backcounter_t *data, struct bcnt_conn *conn, const char *user,
+                       const struct bcnt_dim *dim, struct bcnt_dim_state *ds, int64_t sum)
+{
+	int64_t excess, delta;
+	int64_t oldleft = ds->left, oldprepaid = ds->prepaid;
+	int64_t *targetcur, *targetold;
+	const int *targethas;
+	const char *vapname;
+	char value[32];
+	int i;
+
+	/* handle special cases */
+	if ((!ds->has_left || ds->left < 0) && (!ds->has_prepaid || ds->prepaid < 0)) {
+		/* handle case when both counters are negative or not set (ie. no limits) */
+		bcnt_log(L_DBG, "user %s: nothing to do in dimension %s", user, dim->name);
+		return 0;
+	}
+	else if (ds->left <= 0 && ds->prepaid <= 0) {
+		/* handle case when both counters are nonpositive (ie. limit reached) */
+		bcnt_log(L_INFO, "user %s has already reached their limit of %s!", user, dim->name);
+		return 0;
+	}
+
+	/* select first counter to subtract from */
+	targetcur = (data->prepaidfirst) ? &ds->prepaid : &ds->left;
+
+	/* subtract */
+	*targetcur = bcnt_add(*targetcur, -sum);
+
+	/* handle case when we have to subtract also from the second counter */
+	if (*targetcur < 0) {
+		if (data->prepaidfirst) {
+			ds->left = bcnt_add(ds->left, ds->prepaid); /* add negative value */
+			ds->prepaid = 0;
+			targetcur = &ds->left;
+		}
+		else {
+			ds->prepaid = bcnt_add(ds->prepaid, ds->left); /* add negative value */
+			ds->left = 0;
+			targetcur = &ds->prepaid;
+		}
+
+		if (*targetcur < 0) {
+			excess = (*targetcur == INT64_MIN) ? INT64_MAX : -(*targetcur);
+			bcnt_log(L_INFO, "user %s has used %" PRId64 " more than allowed in dimension %s",
+			         user, excess, dim->name);
+			bcnt_event(data, "overshoot", user, 1, "excess=%" PRId64 " dimension=%s",
+			           excess, dim->name);
+			*targetcur = 0;        /* can't be negative */
+		}
+	}
+
+	/* store new counters in database: subtract what was used rather than write the values
+	 * read above, so top-ups made in the meantime are kept */
+	for (i = 0, vapname = dim->leftvap, targetcur = &ds->left, targetold = &oldleft,
+	     targethas = &ds->has_left; i < 2;
+	     vapname = dim->prepaidvap, targetcur = &ds->prepaid, targetold = &oldprepaid,
+	     targethas = &ds->has_prepaid, i++) {
+		/* there is no row to update, or nothing to change */
+		delta = *targetold - *targetcur;
+		if (!*targethas || delta == 0)
+			continue;
+
+		/* a negative counter (no limit) was zeroed: nothing to race with */
+		snprintf(value, sizeof(value), "%" PRId64, delta > 0 ? delta : *targetcur);
+		if (!bcnt_tpl_query(__LINE__, data, conn, delta > 0 ? BCNT_Q_CHARGE : BCNT_Q_UPDATE,
+		    user, vapname, value))
+			return -1;
+		bcnt_finish(data, conn);
+	}
+
+	return 1;
+}
+
+/** Answers authorize of user over limit in some dimension
+ * @param cached           true if state comes from the overlimit cache
+ * @return RLM_MODULE_OK with overvap added, or RLM_MODULE_USERLOCK if there's no overvap */
+static int bcnt_overlimit(rlm_backcounter_t *data, REQUEST *request, const char *user,
+                          const struct bcnt_state *state, int cached)
+{
+	VALUE_PAIR *vp;
+	const struct bcnt_dim_state *ds;
+	int i;
+
+	/* the first exhausted dimension decides */
+	for (i = 0; i < data->dims_count - 1; i++) {
+		ds = &state->dims[i];
+		if (BCNT_LIMITED(ds) && ds->counter <= 0)
+			break;
+	}
+	ds = &state->dims[i];
+
+	BCNT_STAT_INC(data, overlimit);
+	bcnt_event(data, "overlimit", user, 1, "counter=%" PRId64 " dimension=%s action=%s%s",
+	           ds->counter, data->dims[i]->name,
+	           data->overvap_attr ? "overvap" : "reject", cached ? " cached=yes" : "");
+
+	if (data->overvap_attr) {
+		bcnt_log(L_DBG, "user %s is over limit of %s - adding '%s' attribute",
+		         user, data->dims[i]->name, data->overvap);
+
+		/* set overvap_attr to 1 */
+		vp = radius_paircreate(request, &request->reply->vps,
+		                       data->overvap_attr, PW_TYPE_INTEGER);
+		vp->vp_integer = 1;
+
+		/* accept user */
+		return RLM_MODULE_OK;
+	}
+
+	bcnt_log(L_DBG, "user %s is over limit of %s - rejecting access",
+	         user, data->dims[i]->name);
+
+	/* reject access */
+	BCNT_STAT_INC(data, rejects);
+	return RLM_MODULE_USERLOCK;
+}
+
 /** Increases main counter on reset, adds proper VAPs depending on counter values */
 static int backcounter_authorize(void *instance, REQUEST *request)
 {
 	VALUE_PAIR *vp = NULL, *user;
-	SQLSOCK *sqlsock;
-	double counter;
-	double resetval;
+	struct bcnt_conn *conn;
 	uint32_t curtime;
 	uint32_t rsttime;
+	time_t until;
 	struct bcnt_level *level;
 	uint32_t session_timeout;
+	struct bcnt_state *state;
+	struct bcnt_dim_state *ds;
+	struct bcnt_dim *dim;
+	size_t size;
+	int i, limited = 0, over = 0;
 
 	rlm_backcounter_t *data = (rlm_backcounter_t *) instance;
 
+	BCNT_STAT_INC(data, authorize);
 	curtime = (uint32_t) time(NULL);
 
 	/* get real username */
@@ -585,217 +4604,159 @@ static int backcounter_authorize(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
+	/* keep what we fetch in request, for backcounter_xlat() */
+	size = sizeof(*state) + sizeof(struct bcnt_dim_state) * (data->dims_count - 1);
+	state = rad_malloc(size);
+	memset(state, 0, size);
+	if (request_data_add(request, data, 0, state, free) < 0) {
+		free(state);
+		bcnt_log(L_ERR, "couldn't store counters in request");
+		return RLM_MODULE_FAIL;
+	}
+
+	/* users over limit keep retrying: answer them from cache, without SQL */
+	if (bcnt_cache_get(&data->overlimit, user->vp_strvalue, (char *) state, size, curtime) == 1) {
+		bcnt_log(L_DBG, "user '%s' is over limit (cached)", user->vp_strvalue);
+
+		level = bcnt_find_level(data->levels, curtime, &session_timeout);
+		if (level) {
+			vp = radius_paircreate(request, &request->reply->vps, PW_SESSION_TIMEOUT, PW_TYPE_INTEGER);
+			vp->vp_integer = session_timeout;
+		}
+
+		return bcnt_overlimit(data, request, user->vp_strvalue, state, 1);
+	}
+
 	/* get our database connection */
-	sqlsock = sql_get_socket(data->sqlinst);
-	if (!sqlsock) {
+	conn = bcnt_conn_get(data);
+	if (!conn) {
 		bcnt_log(L_ERR, "error while requesting an SQL socket");
 		return RLM_MODULE_FAIL;
 	}
 
 	/* fetch *resetvap */
 	if (!data->noreset)
-	switch (bcnt_select(__LINE__, data, sqlsock,
-	        "SELECT `Value` FROM `radreply` "
-	        "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
+	switch (bcnt_tpl_select(__LINE__, data, conn, BCNT_Q_RESET,
 	        user->vp_strvalue, data->resetvap)) {
 		case -1: /* no results */
 			bcnt_log(L_DBG, "user '%s' has no '%s' attribute set in radreply table",
 			         user->vp_strvalue, data->resetvap);
 			break;
 		case 0: /* db error */
-			sql_release_socket(data->sqlinst, sqlsock);
+			bcnt_conn_release(data, conn);
 			return RLM_MODULE_FAIL;
 		default: /* there *is* reset timer set */
-			rsttime = strtoul(sqlsock->row[0], (char **) NULL, 10);
-			bcnt_select_finish(data, sqlsock);
+			rsttime = strtoul(conn->row[0], (char **) NULL, 10);
+			bcnt_select_finish(data, conn);
 
 			/* if it's reset time */
-			if (curtime > rsttime) {
-			 	/* set user's leftvap to the value of limitvap (may be in group reply) */
-				bcnt_log(L_DBG, "resetting user '%s' counter", user->vp_strvalue);
-
-				/* if <= 0, we won't update db */
-				resetval = 0.0;
-
-				/* fetch limitvap from user */
-				switch (bcnt_select(__LINE__, data, sqlsock,
-				        "SELECT `Value` FROM `radreply` "
-				        "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
-				        user->vp_strvalue, data->limitvap)) {
-					case -1: /* no results */
-						/* fetch limitvap from group */
-						switch (bcnt_select(__LINE__, data, sqlsock,
-						        "SELECT `radgroupreply`.`value` FROM `radgroupreply`, `usergroup` "
-						        "WHERE "
-						        	"`usergroup`.`username`  = '%s' AND "
-						        	"`usergroup`.`groupname` = `radgroupreply`.`groupname` AND "
-						        	"`radgroupreply`.`attribute` = '%s' "
-						        "ORDER BY `usergroup`.`priority` "
-						        "LIMIT 1",
-						        user->vp_strvalue, data->limitvap)) {
-							case -1: /* no results */
-								break;
-							case 0: /* db error */
-								sql_release_socket(data->sqlinst, sqlsock);
-								return RLM_MODULE_FAIL;
-							default:
-								resetval = strtod(sqlsock->row[0], (char **) NULL);
-								bcnt_log(L_DBG, "using resetval defined in radgroupreply: %.0f", resetval);
-								bcnt_select_finish(data, sqlsock);
-								break;
-						}
-						break;
-					case 0: /* db error */
-						sql_release_socket(data->sqlinst, sqlsock);
-						return RLM_MODULE_FAIL;
-					default:
-						resetval = strtod(sqlsock->row[0], (char **) NULL);
-						bcnt_log(L_DBG, "using resetval defined in radreply: %.0f", resetval);
-						bcnt_select_finish(data, sqlsock);
-						break;
-				}
-
-				if (resetval > 0) {
-					/* update leftvap in db */
-					if (!bcnt_query(__LINE__, data, sqlsock,
-					    "UPDATE `radreply` SET `Value` = '%.0f' "
-					    "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
-					    resetval, user->vp_strvalue, data->leftvap)) {
-						sql_release_socket(data->sqlinst, sqlsock);
-						return RLM_MODULE_FAIL;
-					}
-					bcnt_finish(data, sqlsock);
-
-				 	/* update next reset time (make sure it's greater than current time) */
-					while (rsttime < curtime)
-						rsttime += data->period;
-
-					bcnt_log(L_DBG, "new reset time for user '%s': %u", user->vp_strvalue, rsttime);
-
-					/* update resetvap in db */
-					if (!bcnt_query(__LINE__, data, sqlsock,
-					    "UPDATE `radreply` SET `Value` = '%u' "
-					    "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
-					    rsttime, user->vp_strvalue, data->resetvap)) {
-						sql_release_socket(data->sqlinst, sqlsock);
-						return RLM_MODULE_FAIL;
-					}
-					bcnt_finish(data, sqlsock);
-				}
-				else {
-					bcnt_log(L_INFO, "couldn't fetch resetval although it's reset time: user '%s'",
-						user->vp_strvalue);
-				}
+			if (curtime > rsttime &&
+			    !bcnt_reset(data, conn, user->vp_strvalue, curtime, &rsttime)) {
+				bcnt_conn_release(data, conn);
+				return RLM_MODULE_FAIL;
 			}
 
+			state->reset = rsttime;
 			break;
 	}
 
-	/* fetch sum of *leftvap and *prepaidvap values from user radreply entries */
-	switch (bcnt_select(__LINE__, data, sqlsock,
-	        "SELECT SUM(`Value`) FROM `radreply` "
-	        "WHERE "
-	        	"`UserName` = '%s' AND "
-	        	"`Attribute` IN ('%s', '%s') LIMIT 1",
-	        user->vp_strvalue, data->leftvap, data->prepaidvap)) {
-		case -1: /* no results, but should not happen in this query  */
-			bcnt_log(L_ERR, "should not happen");
-			sql_release_socket(data->sqlinst, sqlsock);
+	/* fetch *leftvap and *prepaidvap values of all dimensions from user radreply entries */
+	switch (bcnt_counters(data, conn, user->vp_strvalue, state->dims)) {
+		case -1: /* no results */
+			bcnt_log(L_DBG, "user '%s' has no counters set in radreply table",
+			         user->vp_strvalue);
+
+			bcnt_conn_release(data, conn);
 			return RLM_MODULE_NOOP;
 		case 0: /* db error */
-			sql_release_socket(data->sqlinst, sqlsock);
+			bcnt_conn_release(data, conn);
 			return RLM_MODULE_FAIL;
-		default:
-			if (sqlsock->row && sqlsock->row[0]) {
-				counter = strtod(sqlsock->row[0], (char **) NULL);
-			}
-			else {
-				bcnt_log(L_DBG, "user '%s' has no '%s' nor '%s' attributes set in radreply table",
-				         user->vp_strvalue, data->leftvap, data->prepaidvap);
-
-				sql_release_socket(data->sqlinst, sqlsock);
-				return RLM_MODULE_NOOP;
-			}
-
-			bcnt_select_finish(data, sqlsock);
-			break;
 	}
 
 	/* Handle levels
 	 * 1. check if we are in some level, if not: skip this part
-	 * 2. multiply counter by the level factor
+	 * 2. multiply counters by the level factor
 	 * 3. set session time limit on the moment when the level ends
 	 */
 	level = bcnt_find_level(data->levels, curtime, &session_timeout);
 	if (level) {
-		/* update the counter */
-		counter /= level->factor;
-
 		/* add session timeout */
 		vp = radius_paircreate(request, &request->reply->vps, PW_SESSION_TIMEOUT, PW_TYPE_INTEGER);
 		vp->vp_integer = session_timeout;
 
-		bcnt_log(L_DBG, "from %d each %d for %d use %g -> counter=%g, session-timeout=%d\n",
-			level->from, level->each, level->length, level->factor,
-			counter, session_timeout);
+		bcnt_log(L_DBG, "from %d each %d for %d use %g -> session-timeout=%d\n",
+			level->from, level->each, level->length, (double) level->factor / RLM_BC_FP_ONE,
+			session_timeout);
+	}
+
+	/* compute counters of all dimensions */
+	for (i = 0; i < data->dims_count; i++) {
+		ds = &state->dims[i];
+		if (!BCNT_LIMITED(ds))
+			continue;
+
+		limited++;
+		ds->counter = bcnt_add(ds->left, ds->prepaid);
+
+		/* update the counter */
+		if (level)
+			ds->counter = bcnt_scale(ds->counter, RLM_BC_FP_ONE, level->factor);
+
+		bcnt_log(L_DBG, "user '%s' dimension %s: counter=%" PRId64,
+		         user->vp_strvalue, data->dims[i]->name, ds->counter);
+
+		if (ds->counter <= 0)
+			over = 1;
+	}
+
+	if (!limited) {
+		bcnt_log(L_DBG, "user '%s' has no '%s' nor '%s' attributes set in radreply table",
+		         user->vp_strvalue, data->main.leftvap, data->main.prepaidvap);
+
+		bcnt_conn_release(data, conn);
+		return RLM_MODULE_NOOP;
 	}
 
 	/* Below code handles four cases:
-	 * 1. user is under limit (has some counter left)
-	 *   1.1. uses vp to add guardvap to response, or
+	 * 1. user is under limit in all dimensions (has some counter left)
+	 *   1.1. uses vp to add guardvaps to response, or
 	 *   1.2. logs a warning msg if guardvap is not configured
-	 * 2. user is over limit
+	 * 2. user is over limit in some dimension
 	 *   2.1. uses vp to add overvap to request, or
 	 *   2.2. rejects access, if overvap is not configured
 	 */
-	if (counter > 0) { /* under limit */
-		if (data->guardvap_attr) {
-			/* set guardvap_attr to counter */
-			vp = radius_paircreate(request, &request->reply->vps,
-			                       data->guardvap_attr, PW_TYPE_INTEGER);
-
-			if (counter > UINT32_MAX) {
-				if (data->giga_guardvap_attr) {
-					vp->vp_integer = (uint32_t) counter;
-
-					/* set higher bits 32..63 */
-					vp = radius_paircreate(request, &request->reply->vps,
-					                       data->giga_guardvap_attr, PW_TYPE_INTEGER);
-					vp->vp_integer = (uint32_t) (counter / UINT32_MAX);
-				} else {
-					/* set the maximum possible value */
-					vp->vp_integer = UINT32_MAX;
-				}
-			} else {
-				vp->vp_integer = (uint32_t) counter;
+	if (!over) { /* under limit */
+		for (i = 0; i < data->dims_count; i++) {
+			dim = data->dims[i];
+			if (!BCNT_LIMITED(&state->dims[i]))
+				continue;
+
+			if (!dim->guardvap_attr) {
+				bcnt_log(L_DBG, "warning: no guardvap attribute set in dimension %s", dim->name);
+				continue;
 			}
-		}
-		else {
-			bcnt_log(L_DBG, "warning: no guardvap attribute set");
+
+			/* dimensions sharing guardvap end up with the smallest counter */
+			bcnt_guard(request, dim, state->dims[i].counter);
 		}
 	}
 	else { /* over limit */
-		if (data->overvap_attr) {
-			bcnt_log(L_DBG, "user %s is over limit - adding '%s' attribute",
-			         user->vp_strvalue, data->overvap);
+		bcnt_conn_release(data, conn);
 
-			/* set overvap_attr to 1 */
-			vp = radius_paircreate(request, &request->reply->vps,
-			                       data->overvap_attr, PW_TYPE_INTEGER);
-			vp->vp_integer = 1;
-		}
-		else {
-			bcnt_log(L_DBG, "user %s is over limit - rejecting access",
-			         user->vp_strvalue);
+		/* remember until the counters may change: TTL, or the next reset */
+		until = curtime + data->overlimit_cache_ttl;
+		if (state->reset && state->reset < until)
+			until = state->reset;
 
-			/* reject access */
-			sql_release_socket(data->sqlinst, sqlsock);
-			return RLM_MODULE_USERLOCK;
-		}
+		if (until > curtime)
+			bcnt_cache_put_until(data, &data->overlimit, user->vp_strvalue,
+			                     (char *) state, size, until);
+
+		return bcnt_overlimit(data, request, user->vp_strvalue, state, 0);
 	}
 
 	/* accept user */
-	sql_release_socket(data->sqlinst, sqlsock);
+	bcnt_conn_release(data, conn);
 	return RLM_MODULE_OK;
 }
 
@@ -803,19 +4764,21 @@ static int backcounter_authorize(void *instance, REQUEST *request)
 static int backcounter_accounting(void *instance, REQUEST *request)
 {
 	VALUE_PAIR *vp, *user;
-	SQLSOCK *sqlsock;
-	double sum = 0.0;
-	double curleft, curprepaid;
-	int i;
-	char *vapname;
-	double *targetcur;
-	uint32_t curtime;
+	VALUE_PAIR *slots[RLM_BC_MAX_SLOTS];
+	struct bcnt_conn *conn;
+	int64_t sums[RLM_BC_MAX_DIMS], raw;
+	struct bcnt_dim_state st[RLM_BC_MAX_DIMS];
+	int i, r, charged = 0, flush = 0;
+	uint32_t curtime, stoptime;
 	struct bcnt_level *level;
 
 	rlm_backcounter_t *data = (rlm_backcounter_t *) instance;
 
+	/* fetch all the attributes we need at once */
+	bcnt_plan_extract(data, request->packet->vps, slots);
+
 	/* react only to PW_STATUS_STOP packets */
-	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE);
+	vp = slots[BCNT_SLOT_STATUS_TYPE];
 	if (!vp) {
 		bcnt_log(L_ERR, "couldn't find type of accounting packet");
 		return RLM_MODULE_FAIL;
@@ -831,135 +4794,105 @@ static int backcounter_accounting(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	/* connect to database */
-	sqlsock = sql_get_socket(data->sqlinst);
-	if (!sqlsock) {
-		bcnt_log(L_ERR, "couldn't connect to database");
-		return RLM_MODULE_FAIL;
-	}
-
-	/* fetch *leftvap and *prepaidvap values from user radreply entries */
-	for (i = 0, vapname = data->leftvap, targetcur = &curleft; i < 2;
-	     vapname = data->prepaidvap, targetcur = &curprepaid, i++) {
-		switch (bcnt_select(__LINE__, data, sqlsock,
-		        "SELECT `Value` FROM `radreply` "
-		        "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
-		        user->vp_strvalue, vapname)) {
-			case -1: /* no results */
-				bcnt_log(L_DBG, "user %s has no %s attribute set in radreply table",
-				         user->vp_strvalue, vapname);
-				*targetcur = -0.1;
-				break;
-			case 0: /* db error */
-				sql_release_socket(data->sqlinst, sqlsock);
-				return RLM_MODULE_FAIL;
-			default: /* ok */
-				*targetcur = strtod(sqlsock->row[0], (char **) NULL);
-				bcnt_select_finish(data, sqlsock);
-				break;
-		}
-	}
-
-	/* handle special cases */
-	if (curleft < 0 && curprepaid < 0) {
-		/* handle case when both counters are negative (ie. no limits) */
-		bcnt_log(L_DBG, "user %s: nothing to do", user->vp_strvalue);
-		sql_release_socket(data->sqlinst, sqlsock);
-		return RLM_MODULE_NOOP;
-	}
-	else if (curleft <= 0 && curprepaid <= 0) {
-		/* handle case when both counters are nonpositive (ie. limit reached) */
-		bcnt_log(L_INFO, "user %s has already reached his limit!", user->vp_strvalue);
-		sql_release_socket(data->sqlinst, sqlsock);
-		return RLM_MODULE_NOOP;
-	}
+	BCNT_STAT_INC(data, accounting);
 
-	/* sum session counters */
-	for (i = 0; data->count_attrs[i]; i++) {
-		vp = pairfind(request->packet->vps, data->count_attrs[i]);
-		if (!vp) {
-			bcnt_log(L_DBG, "couldn't find attribute #%u to subtract from counters",
-			         data->count_attrs[i]);
-		}
-		else {
-			/* FIXME: the attribute may not be of "integer" type (check vp->type) */
-			sum += vp->vp_integer;
-		}
-	}
+	/* sum session counters of each dimension */
+	for (i = 0; i < data->dims_count; i++)
+		sums[i] = bcnt_dim_sum(data, data->dims[i], slots);
 
 	/*
 	 * handle levels
 	 */
 	curtime = (uint32_t) time(NULL);
 
-	/* subtract Acct-Session-Time */
-	vp = pairfind(request->packet->vps, PW_ACCT_SESSION_TIME);
+	/* subtract Acct-Delay-Time */
+	vp = slots[BCNT_SLOT_DELAY_TIME];
 	if (vp) {
 		curtime -= vp->vp_integer;
 	}
 
-	/* subtract Acct-Delay-Time */
-	vp = pairfind(request->packet->vps, PW_ACCT_DELAY_TIME);
+	/* session end time */
+	stoptime = curtime;
+
+	/* subtract Acct-Session-Time */
+	vp = slots[BCNT_SLOT_SESSION_TIME];
 	if (vp) {
 		curtime -= vp->vp_integer;
 	}
 
+	raw = sums[0];
+
 	/* get the level that was active at connection start */
 	level = bcnt_find_level(data->levels, curtime, NULL);
 	if (level) {
-		sum *= level->factor;
+		for (i = 0; i < data->dims_count; i++)
+			sums[i] = bcnt_scale(sums[i], level->factor, RLM_BC_FP_ONE);
 
-		bcnt_log(L_DBG, "time=%d -> from %d each %d for %d use %g -> sum=%g\n",
-			curtime, level->from, level->each, level->length, level->factor, sum);
+		bcnt_log(L_DBG, "time=%d -> from %d each %d for %d use %g -> sum=%" PRId64 "\n",
+			curtime, level->from, level->each, level->length,
+			(double) level->factor / RLM_BC_FP_ONE, sums[0]);
 	}
 
-	/* select first counter to subtract from */
-	targetcur = (data->prepaidfirst) ? &curprepaid : &curleft;
+	/* account the session in hourly rollups (main dimension only) */
+	if (data->rollup)
+		flush = bcnt_rollup_add(data, user->vp_strvalue, stoptime, raw, sums[0]);
 
-	/* subtract */
-	*targetcur -= sum;
+	/* connect to database */
+	conn = bcnt_conn_get(data);
+	if (!conn) {
+		bcnt_log(L_ERR, "couldn't connect to database");
 
-	/* handle case when we have to subtract also from the second counter */
-	if (*targetcur < 0) {
-		if (data->prepaidfirst) {
-			curleft += curprepaid; /* add negative value */
-			curprepaid = 0.0;
-			targetcur = &curleft;
-		}
-		else {
-			curprepaid += curleft; /* add negative value */
-			curleft = 0.0;
-			targetcur = &curprepaid;
+		if (flush) {
+			pthread_mutex_lock(&data->rollup_mutex);
+			data->rollup_flushing = 0;
+			pthread_mutex_unlock(&data->rollup_mutex);
 		}
 
-		if (*targetcur < 0) {
-			bcnt_log(L_INFO, "user %s has sent %.0f more bytes than he should",
-			         user->vp_strvalue, -(*targetcur));
-			*targetcur = 0.0;      /* can't be negative */
-		}
+		return RLM_MODULE_FAIL;
+	}
+
+	if (flush)
+		bcnt_rollup_flush(data, conn);
+
+	/* fetch *leftvap and *prepaidvap values of all dimensions from user radreply entries */
+	memset(st, 0, sizeof(st));
+	switch (bcnt_counters(data, conn, user->vp_strvalue, st)) {
+		case -1: /* no results */
+			bcnt_log(L_DBG, "user %s: nothing to do", user->vp_strvalue);
+			bcnt_conn_release(data, conn);
+			return RLM_MODULE_NOOP;
+		case 0: /* db error */
+			bcnt_conn_release(data, conn);
+			return RLM_MODULE_FAIL;
 	}
 
-	/* store new counters in database */
-	for (i = 0, vapname = data->leftvap, targetcur = &curleft; i < 2;
-	     vapname = data->prepaidvap, targetcur = &curprepaid, i++) {
-		if (!bcnt_query(__LINE__, data, sqlsock,
-		    "UPDATE `radreply` SET `Value` = '%.0f' "
-		    "WHERE `UserName` = '%s' AND `Attribute` = '%s' LIMIT 1",
-		    *targetcur, user->vp_strvalue, vapname)) {
-			sql_release_socket(data->sqlinst, sqlsock);
+	for (i = 0; i < data->dims_count; i++) {
+		r = bcnt_charge(data, conn, user->vp_strvalue, data->dims[i], &st[i], sums[i]);
+		if (r < 0) {
+			bcnt_conn_release(data, conn);
 			return RLM_MODULE_FAIL;
 		}
-		bcnt_finish(data, sqlsock);
+
+		charged += r;
 	}
 
-	sql_release_socket(data->sqlinst, sqlsock);
-	return RLM_MODULE_OK;
+	bcnt_conn_release(data, conn);
+	return charged ? RLM_MODULE_OK : RLM_MODULE_NOOP;
 }
 
+/* Instance configuration is never modified after instantiation, so on HUP the server can
+ * build a new instance next to the old one, swap them, and detach the old one
+ * after the requests in progress are done with it. */
+#ifdef RLM_TYPE_HUP_SAFE
+# define RLM_BC_TYPE (RLM_TYPE_THREAD_SAFE | RLM_TYPE_HUP_SAFE)
+#else
+# define RLM_BC_TYPE RLM_TYPE_THREAD_SAFE
+#endif
+
 module_t rlm_backcounter = {
 	RLM_MODULE_INIT,
 	"backcounter",               /* name */
-	RLM_TYPE_THREAD_SAFE,        /* type */
+	RLM_BC_TYPE,                 /* type */
 	backcounter_instantiate,     /* instantiation */
 	backcounter_detach,          /* detach */
 	{
@@ -0,0 +1,126 @@
+/*
+ * rlm_backcounter_int.h
+ * Integer counter math of rlm_backcounter, shared with bcnt_math_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef RLM_BACKCOUNTER_INT_H
+#define RLM_BACKCOUNTER_INT_H
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
+
+/* level factors are fixed-point numbers: RLM_BC_FP_ONE is 1.0, the max is 1000.0 */
+#define RLM_BC_FP_ONE 1000000
+#define RLM_BC_FP_MAX ((int64_t) 1000 * RLM_BC_FP_ONE)
+
+/** a + b, saturating at the limits of int64_t */
+static inline int64_t bcnt_add(int64_t a, int64_t b)
+{
+	if (b > 0 && a > INT64_MAX - b)
+		return INT64_MAX;
+	if (b < 0 && a < INT64_MIN - b)
+		return INT64_MIN;
+
+	return a + b;
+}
+
+/** a * mul / div (rounded towards zero), saturating
+ * @param mul              fixed-point factor, 0 .. RLM_BC_FP_MAX
+ * @param div              fixed-point factor, 0 .. RLM_BC_FP_MAX; if 0, the result
+ *                         is as far from 0 as possible */
+static inline int64_t bcnt_scale(int64_t a, int64_t mul, int64_t div)
+{
+	int64_t q, r;
+
+	if (div == 0)
+		return (a > 0) ? INT64_MAX : (a < 0) ? INT64_MIN : 0;
+
+	/* a = q * div + r, where |r * mul| < RLM_BC_FP_MAX^2 fits */
+	q = a / div;
+	r = a % div;
+
+	if (mul && (q > INT64_MAX / mul || q < INT64_MIN / mul))
+		return (q > 0) ? INT64_MAX : INT64_MIN;
+
+	return bcnt_add(q * mul, r * mul / div);
+}
+
+/** Parses counter value stored in db
+ * @return value, saturated; 0 if NULL */
+static inline int64_t bcnt_parse(const char *str)
+{
+	char *end;
+	int64_t val;
+	double d;
+
+	if (!str)
+		return 0;
+
+	val = strtoll(str, &end, 10);   /* saturates on overflow */
+
+	/* someone has put a fraction there */
+	if (*end == '.' || *end == 'e' || *end == 'E') {
+		d = strtod(str, (char **) NULL);
+		if (d >= 9223372036854775808.0)
+			return INT64_MAX;
+		if (d <= -9223372036854775808.0)
+			return INT64_MIN;
+		return (int64_t) d;
+	}
+
+	return val;
+}
+
+/** Parses decimal number into fixed point, dropping digits below its precision
+ * @return at most RLM_BC_FP_MAX + 1 */
+static inline int64_t bcnt_fixed(const char *str)
+{
+	int64_t val = 0, unit = RLM_BC_FP_ONE;
+
+	for (; isdigit((int) *str); str++) {
+		val = val * 10 + (*str - '0');
+		if (val > RLM_BC_FP_MAX / RLM_BC_FP_ONE)
+			return RLM_BC_FP_MAX + 1;
+	}
+	val *= RLM_BC_FP_ONE;
+
+	if (*str == '.') {
+		for (str++; isdigit((int) *str) && unit > 1; str++) {
+			unit /= 10;
+			val += (*str - '0') * unit;
+		}
+	}
+
+	return (val > RLM_BC_FP_MAX) ? RLM_BC_FP_MAX + 1 : val;
+}
+
+/** Splits counter into its lower and higher 32 bits
+ * @param high             set to bits 32..63; if NULL, counters that do not fit
+ *                         in 32 bits are cut to UINT32_MAX
+ * @return bits 0..31 */
+static inline uint32_t bcnt_split(int64_t counter, uint32_t *high)
+{
+	if (high)
+		*high = (counter > UINT32_MAX) ? (uint32_t) (counter >> 32) : 0;
+	else if (counter > UINT32_MAX)
+		return UINT32_MAX;
+
+	return (uint32_t) (counter & 0xffffffff);
+}
+
+#endif /* RLM_BACKCOUNTER_INT_H */